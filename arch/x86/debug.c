@@ -1,6 +1,9 @@
 #include <c4/klib/string.h>
 #include <c4/arch/paging.h>
 #include <c4/arch/ioports.h>
+#include <c4/arch/interrupts.h>
+#include <c4/arch/pic.h>
+#include <c4/arch/debug.h>
 #include <c4/debug.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -50,6 +53,17 @@ enum {
 	SERIAL_LINESTAT_TRANSMIT_EMPTY = (1 << 5),
 };
 
+// fields in SERIAL_IDENT_CONTROL when written, which sets up the FIFOs
+enum {
+	SERIAL_FIFO_ENABLE         = (1 << 0),
+	SERIAL_FIFO_CLEAR_RECIEVE  = (1 << 1),
+	SERIAL_FIFO_CLEAR_TRANSMIT = (1 << 2),
+	SERIAL_FIFO_TRIGGER_14     = (3 << 6),
+
+	// bytes that can be written each time the transmit FIFO is empty
+	SERIAL_FIFO_SIZE           = 16,
+};
+
 // fields in SERIAL_INTERRUPT_ENABLE register
 enum {
 	SERIAL_INTERRUPT_HAS_DATA       = (1 << 0),
@@ -105,16 +119,107 @@ static bool serial_can_transmit( void ){
 	return temp & SERIAL_LINESTAT_TRANSMIT_EMPTY;
 }
 
-void debug_putchar( int c ){
-	static bool initialized = false;
+// when defined, output goes to the QEMU/bochs debug console port instead
+// of the serial port, which takes bytes as fast as they're written
+#ifdef DEBUG_PORT_E9
+enum {
+	DEBUG_PORT = 0xe9,
+};
+#endif
+
+static bool initialized = false;
+// set once the transmit-empty interrupt is handled, until then output is
+// written out synchronously
+static bool async_output = false;
+// only one context writes to the uart at a time, anything that finds it
+// busy leaves the work to whoever has it
+static int draining = 0;
+
+static void serial_init( void ){
+	set_charsize( 8 );    /* 8 bits */
+	set_divisor( 1 );     /* 115200 baud */
+	set_interrupts( 0 );  /* all disabled */
+
+	write_register( SERIAL_DEFAULT, SERIAL_IDENT_CONTROL,
+	                SERIAL_FIFO_ENABLE
+	              | SERIAL_FIFO_CLEAR_RECIEVE
+	              | SERIAL_FIFO_CLEAR_TRANSMIT
+	              | SERIAL_FIFO_TRIGGER_14 );
+
+	initialized = true;
+}
+
+// fills the transmit FIFO from the log ring, if it's empty
+static void serial_drain( void ){
+	if ( !serial_can_transmit( )){
+		return;
+	}
+
+	for ( unsigned i = 0; i < SERIAL_FIFO_SIZE; i++ ){
+		int c = debug_ring_getchar( );
+
+		if ( c < 0 ){
+			break;
+		}
+
+		write_register( SERIAL_DEFAULT, SERIAL_DATA, c );
+	}
+}
+
+void debug_flush( void ){
+	int c;
 
 	if ( !initialized ){
-		set_charsize( 8 );    /* 8 bits */
-		set_divisor( 1 );     /* 115200 baud */
-		set_interrupts( 0 );  /* all disabled */
-		initialized = true;
+		serial_init( );
 	}
 
-	while ( !serial_can_transmit( ));
-	write_register( SERIAL_DEFAULT, SERIAL_DATA, c );
+	while (( c = debug_ring_getchar( )) >= 0 ){
+#ifdef DEBUG_PORT_E9
+		outb( DEBUG_PORT, c );
+#else
+		while ( !serial_can_transmit( ));
+		write_register( SERIAL_DEFAULT, SERIAL_DATA, c );
+#endif
+	}
+}
+
+void debug_output_kick( void ){
+	if ( __atomic_exchange_n( &draining, 1, __ATOMIC_ACQUIRE )){
+		return;
+	}
+
+#ifdef DEBUG_PORT_E9
+	debug_flush( );
+#else
+	if ( !async_output ){
+		debug_flush( );
+
+	} else {
+		serial_drain( );
+	}
+#endif
+
+	__atomic_store_n( &draining, 0, __ATOMIC_RELEASE );
+}
+
+static void serial_interrupt( interrupt_frame_t *frame ){
+	// reading the ident register acknowledges the interrupt
+	read_register( SERIAL_DEFAULT, SERIAL_IDENT_CONTROL );
+	debug_output_kick( );
+}
+
+// switches to draining the log from the transmit-empty interrupt, so
+// logging doesn't wait on the uart
+void init_debug_output( void ){
+	if ( !initialized ){
+		serial_init( );
+	}
+
+#ifndef DEBUG_PORT_E9
+	register_interrupt( INTERRUPT_COM1, serial_interrupt );
+	set_interrupts( SERIAL_INTERRUPT_TRANSMIT_EMPTY );
+	pic_unmask_irq( INTERRUPT_COM1 - INTERRUPT_IRQ_BASE );
+
+	async_output = true;
+#endif
 }
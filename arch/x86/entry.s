@@ -33,12 +33,15 @@ section .data
 ; with a 4MB page at 0x0 and at 0xc0000000.
 ; identity-mapped 0x0 is needed because 'loader' will still
 ; be running at around 0x100000 after paging is initialized
+; the kernel mapping is marked global so it stays in the TLB across
+; address space switches, the identity mapping is removed once we're
+; running in the higher half so it's left as a normal entry
 align 0x1000
 global boot_page_dir
 boot_page_dir:
     dd 0x00000083
     times (KERNEL_PAGE_NUM - 1) dd 0
-    dd 0x00000083
+    dd 0x00000183
     times (1024 - KERNEL_PAGE_NUM - 1) dd 0
 
 section .text
@@ -51,8 +54,9 @@ loader:
     mov ecx, boot_page_dir - KERNEL_VBASE
     mov cr3, ecx
 
+    ; enable 4MB pages (PSE) and global pages (PGE)
     mov ecx, cr4
-    or ecx, 0x10
+    or ecx, 0x90
     mov cr4, ecx
 
     mov ecx, cr0
@@ -0,0 +1,194 @@
+#include <c4/arch/fpu.h>
+#include <c4/arch/interrupts.h>
+#include <c4/thread.h>
+#include <c4/scheduler.h>
+#include <c4/mm/region.h>
+#include <c4/mm/slab.h>
+#include <c4/debug.h>
+#include <c4/common.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// control register and cpuid bits used for fpu management
+enum {
+	CR0_MONITOR_COPROC = 1 << 1,
+	CR0_EMULATION      = 1 << 2,
+	CR0_TASK_SWITCHED  = 1 << 3,
+	CR0_NUMERIC_ERROR  = 1 << 5,
+
+	CR4_OSFXSR         = 1 << 9,
+	CR4_OSXMMEXCPT     = 1 << 10,
+
+	CPUID_EDX_FXSR     = 1 << 24,
+	CPUID_EDX_SSE      = 1 << 25,
+};
+
+enum {
+	MXCSR_DEFAULT = 0x1f80,
+};
+
+// thread whose fpu state is currently loaded in the fpu registers.
+// state is only saved when a different thread touches the fpu, so a thread
+// which is the only fpu user never pays for saving or restoring it.
+//
+// TODO: this will need to be per-cpu once SMP is working
+static thread_t *fpu_owner = NULL;
+static bool      have_fxsr = false;
+static bool      have_sse  = false;
+
+static inline uint32_t read_cr0( void ){
+	uint32_t ret;
+	asm volatile ( "mov %%cr0, %0" : "=r"(ret));
+	return ret;
+}
+
+static inline void write_cr0( uint32_t value ){
+	asm volatile ( "mov %0, %%cr0" :: "r"(value));
+}
+
+static inline uint32_t read_cr4( void ){
+	uint32_t ret;
+	asm volatile ( "mov %%cr4, %0" : "=r"(ret));
+	return ret;
+}
+
+static inline void write_cr4( uint32_t value ){
+	asm volatile ( "mov %0, %%cr4" :: "r"(value));
+}
+
+static inline uint32_t cpuid_features( void ){
+	uint32_t eax = 1, ebx, ecx, edx;
+
+	asm volatile ( "cpuid"
+	               : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+
+	return edx;
+}
+
+static inline void fpu_save( void *state ){
+	if ( have_fxsr ){
+		asm volatile ( "fxsave (%0)" :: "r"(state) : "memory" );
+
+	} else {
+		asm volatile ( "fnsave (%0)" :: "r"(state) : "memory" );
+	}
+}
+
+static inline void fpu_restore( void *state ){
+	if ( have_fxsr ){
+		asm volatile ( "fxrstor (%0)" :: "r"(state) : "memory" );
+
+	} else {
+		asm volatile ( "frstor (%0)" :: "r"(state) : "memory" );
+	}
+}
+
+static inline void fpu_reset( void ){
+	uint32_t mxcsr = MXCSR_DEFAULT;
+
+	asm volatile ( "fninit" );
+
+	if ( have_sse ){
+		asm volatile ( "ldmxcsr %0" :: "m"(mxcsr));
+	}
+}
+
+static slab_t fpu_state_slab;
+
+static void *fpu_state_alloc( void ){
+	void *ret = slab_alloc( &fpu_state_slab );
+
+	KASSERT( ret != NULL );
+
+	return ret;
+}
+
+static void fpu_state_free( void *state ){
+	slab_free( &fpu_state_slab, state );
+}
+
+// called on the first fpu/sse instruction after a thread switch, since
+// CR0.TS is set whenever the thread being switched to doesn't own the fpu
+static void fpu_dev_unavail_handler( interrupt_frame_t *frame ){
+	thread_t *cur = sched_current_thread( );
+
+	asm volatile ( "clts" );
+
+	if ( !cur ){
+		debug_printf( "warning: fpu used with no current thread\n" );
+		return;
+	}
+
+	if ( fpu_owner == cur ){
+		return;
+	}
+
+	if ( fpu_owner ){
+		fpu_save( fpu_owner->registers.fpu_state );
+	}
+
+	if ( cur->registers.fpu_state ){
+		fpu_restore( cur->registers.fpu_state );
+
+	} else {
+		cur->registers.fpu_state = fpu_state_alloc( );
+		fpu_reset( );
+	}
+
+	fpu_owner = cur;
+}
+
+void thread_fpu_switch( thread_t *thread ){
+	uint32_t cr0 = read_cr0( );
+
+	if ( thread == fpu_owner ){
+		if ( cr0 & CR0_TASK_SWITCHED ){
+			asm volatile ( "clts" );
+		}
+
+	} else if ( !(cr0 & CR0_TASK_SWITCHED) ){
+		write_cr0( cr0 | CR0_TASK_SWITCHED );
+	}
+}
+
+void thread_fpu_release( thread_t *thread ){
+	if ( fpu_owner == thread ){
+		fpu_owner = NULL;
+	}
+
+	if ( thread->registers.fpu_state ){
+		fpu_state_free( thread->registers.fpu_state );
+		thread->registers.fpu_state = NULL;
+	}
+}
+
+void init_fpu( void ){
+	uint32_t features = cpuid_features( );
+	uint32_t cr0      = read_cr0( );
+
+	have_fxsr = !!(features & CPUID_EDX_FXSR);
+	have_sse  = have_fxsr && (features & CPUID_EDX_SSE);
+
+	if ( have_fxsr ){
+		write_cr4( read_cr4( )
+		         | CR4_OSFXSR
+		         | (have_sse? CR4_OSXMMEXCPT : 0));
+	}
+
+	cr0 &= ~CR0_EMULATION;
+	cr0 |= CR0_MONITOR_COPROC | CR0_NUMERIC_ERROR;
+	write_cr0( cr0 );
+
+	slab_init_aligned_at( &fpu_state_slab, "fpu_state", region_get_global( ),
+	                      FPU_STATE_SIZE, FPU_STATE_ALIGN, 0,
+	                      NO_CTOR, NO_DTOR );
+
+	fpu_reset( );
+	register_interrupt( INTERRUPT_DEV_UNAVAIL, fpu_dev_unavail_handler );
+
+	// trap on the first fpu instruction, so the first thread to use it
+	// gets a clean state allocated
+	write_cr0( cr0 | CR0_TASK_SWITCHED );
+
+	debug_printf( "(fxsr: %u, sse: %u) ", have_fxsr, have_sse );
+}
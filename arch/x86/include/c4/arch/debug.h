@@ -0,0 +1,6 @@
+#ifndef _C4_ARCH_DEBUG_H
+#define _C4_ARCH_DEBUG_H 1
+
+void init_debug_output( void );
+
+#endif
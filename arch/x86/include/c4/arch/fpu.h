@@ -0,0 +1,13 @@
+#ifndef _C4_ARCH_FPU_H
+#define _C4_ARCH_FPU_H 1
+
+enum {
+	// size and alignment of an fxsave area, the older fnsave format
+	// is smaller and fits in the same space
+	FPU_STATE_SIZE  = 512,
+	FPU_STATE_ALIGN = 16,
+};
+
+void init_fpu( void );
+
+#endif
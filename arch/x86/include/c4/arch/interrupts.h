@@ -41,8 +41,10 @@ enum {
 	INTERRUPT_VIRT_EXCEPT,
 
 	// remapped IRQ vectors, see pic.{c,h}
+	INTERRUPT_IRQ_BASE = 0x20,
 	INTERRUPT_TIMER    = 0x20,
 	INTERRUPT_KEYBOARD = 0x21,
+	INTERRUPT_COM1     = 0x24,
 
 	// user syscall interrupt
 	INTERRUPT_SYSCALL  = 0x60,
@@ -79,6 +81,13 @@ typedef struct interrupt_frame {
 	uint32_t error_num;
 
 	uint32_t eip;
+	uint32_t cs;
+	uint32_t eflags;
+
+	// only pushed for interrupts from user mode, these aren't there
+	// when a kernel thread is interrupted
+	uint32_t user_esp;
+	uint32_t user_ss;
 } __attribute__((packed)) interrupt_frame_t;
 
 typedef void (*intr_handler_t)( interrupt_frame_t *frame );
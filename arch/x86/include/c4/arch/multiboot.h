@@ -21,12 +21,14 @@ enum {
 	MULTIBOOT_MEM_RESERVED  = 2
 };
 
+// 'size' doesn't include the size field itself, entries are
+// size + 4 bytes apart
 typedef struct multiboot_mem_map {
 	uint32_t size;
-	uint32_t addr_high;
 	uint32_t addr_low;
-	uint32_t len_high;
+	uint32_t addr_high;
 	uint32_t len_low;
+	uint32_t len_high;
 	uint32_t type;
 } __attribute__((packed)) multiboot_mem_map_t;
 
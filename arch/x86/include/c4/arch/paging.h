@@ -4,14 +4,33 @@
 #include <stdbool.h>
 
 #define PAGE_SIZE   0x1000
+// size of a page mapped by a single directory entry, with PSE
+#define PAGE_LARGE_SIZE 0x400000
 #define KERNEL_BASE 0xfd000000
 
+// small address spaces live in segment-limited windows below the kernel,
+// each window is covered by one page table which is shared between every
+// page directory, so switching between them doesn't need a CR3 reload.
+// normal address spaces are limited to addresses below SMALL_SPACE_BASE.
+#define SMALL_SPACE_BASE  0xe0000000
+#define SMALL_SPACE_SIZE  0x400000
+#define SMALL_SPACE_SLOTS ((KERNEL_BASE - SMALL_SPACE_BASE) / SMALL_SPACE_SIZE)
+
+// kernel virtual memory for the global region, from the end of the boot
+// mapping up to the recursive page directory mapping
+#define KERNEL_HEAP_BASE (KERNEL_BASE + 0x400000)
+#define KERNEL_HEAP_END  0xffc00000
+
 enum {
 	PAGE_ARCH_PRESENT    = 1 << 0,
 	PAGE_ARCH_WRITABLE   = 1 << 1,
 	PAGE_ARCH_SUPERVISOR = 1 << 2,
 	PAGE_ARCH_ACCESSED   = 1 << 5,
 	PAGE_ARCH_4MB_ENTRY  = 1 << 7,
+	PAGE_ARCH_GLOBAL     = 1 << 8,
+	// available to software, set on entries that were made read-only to
+	// be shared copy on write
+	PAGE_ARCH_COW        = 1 << 9,
 
 	PAGE_ARCH_ALL_FLAGS  = 0xfff,
 };
@@ -138,8 +138,9 @@ void init_segment_descs( void );
 void load_gdt( void *ptr );
 void load_tss( uint32_t seg );
 
+void segment_set_user_window( uint32_t base, uint32_t size );
+
 void set_user_stack( void *addr );
-void kernel_stack_set( void *addr );
 void *kernel_stack_get( void );
 
 #endif
@@ -1,14 +1,23 @@
 #ifndef _C4_ARCH_THREAD_H
 #define _C4_ARCH_THREAD_H 1
+#include <c4/arch/interrupts.h>
 #include <stdint.h>
 
 typedef struct thread thread_t;
 
 typedef struct thread_registers {
+	// saved kernel thread state
 	uint32_t ebp, esp, eip;
-	// this is used to determine whether this thread has already been
-	// run and is in a user context
-	uint32_t do_user_switch;
+	// for user threads, where user_frame is copied to when the thread is
+	// resumed, which is the top of the per-cpu kernel stack. zero for
+	// kernel threads, which are resumed from ebp/esp/eip instead
+	interrupt_frame_t *resume_frame;
+	// fpu/sse save area, allocated the first time the thread uses the fpu
+	void *fpu_state;
+	// user state of a user thread that's switched out. user threads don't
+	// keep anything on the kernel stack while they aren't running, see
+	// sched_thread_block()
+	interrupt_frame_t user_frame;
 } thread_regs_t;
 
 #endif
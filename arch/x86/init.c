@@ -3,6 +3,8 @@
 #include <c4/arch/ioports.h>
 #include <c4/arch/pic.h>
 #include <c4/arch/multiboot.h>
+#include <c4/arch/fpu.h>
+#include <c4/arch/debug.h>
 #include <c4/paging.h>
 #include <c4/debug.h>
 
@@ -10,6 +12,7 @@
 #include <c4/klib/string.h>
 #include <c4/mm/region.h>
 #include <c4/mm/slab.h>
+#include <c4/mm/phys.h>
 #include <c4/common.h>
 
 #include <c4/thread.h>
@@ -17,7 +20,10 @@
 #include <c4/message.h>
 
 void timer_handler( interrupt_frame_t *frame ){
-	sched_switch_thread( );
+	// in case the serial interrupt is lost or masked, log output still
+	// makes progress every tick
+	debug_output_kick( );
+	sched_timer_tick( );
 }
 
 void test_thread_client( void ){
@@ -102,6 +108,45 @@ void meh( void ){
 	}
 }
 
+// maps 'size' bytes at 'vaddr' in the current space, with frames from the
+// physical allocator in the largest blocks that fit, up to 4MB. blocks are
+// aligned to their size, so 4MB blocks at 4MB aligned addresses are mapped
+// with large pages.
+static bool sigma0_map_range( addr_space_t *space, uintptr_t vaddr,
+                              uintptr_t size )
+{
+	while ( size > 0 ){
+		unsigned order = PHYS_MAX_ORDER - 1;
+
+		while ( order > 0 && ((uintptr_t)PAGE_SIZE << order) > size ){
+			order--;
+		}
+
+		uintptr_t phys = phys_alloc( order );
+
+		if ( !phys ){
+			return false;
+		}
+
+		addr_entry_t ent = (addr_entry_t){
+			.virtual     = vaddr,
+			.physical    = phys,
+			.size        = 1 << order,
+			.permissions = PAGE_READ | PAGE_WRITE,
+		};
+
+		// the block is released again if it can't be mapped
+		if ( addr_space_insert_map( space, &ent ) < 0 ){
+			return false;
+		}
+
+		vaddr += (uintptr_t)PAGE_SIZE << order;
+		size  -= (uintptr_t)PAGE_SIZE << order;
+	}
+
+	return true;
+}
+
 void sigma0_load( multiboot_module_t *module ){
 	addr_space_t *new_space = addr_space_clone( addr_space_kernel( ));
 
@@ -109,7 +154,6 @@ void sigma0_load( multiboot_module_t *module ){
 
 	unsigned func_size = module->end - module->start;
 	void *sigma0_addr  = (void *)low_phys_to_virt(module->start);
-	addr_entry_t ent;
 
 	uintptr_t code_start = 0xc0000000;
 	uintptr_t code_end   = code_start + func_size +
@@ -120,31 +164,23 @@ void sigma0_load( multiboot_module_t *module ){
 	void *func      = (void *)code_start;
 	void *new_stack = (void *)(data_start + 0xff8);
 
-	ent = (addr_entry_t){
-		.virtual     = code_start,
-		.physical    = 0x800000,
-		.size        = (code_end - code_start) / PAGE_SIZE,
-		.permissions = PAGE_READ | PAGE_WRITE,
-	};
-
-	addr_space_insert_map( new_space, &ent );
-
-	ent = (addr_entry_t){
-		.virtual     = data_start,
-		.physical    = 0x820000,
-		.size        = (data_end - data_start) / PAGE_SIZE,
-		.permissions = PAGE_READ | PAGE_WRITE,
-	};
+	// frames come from the allocator, since anything in the managed pool
+	// may already be in use by the time sigma0 is loaded
+	if ( !sigma0_map_range( new_space, code_start, code_end - code_start )
+	  || !sigma0_map_range( new_space, data_start, data_end - data_start ))
+	{
+		debug_printf( "Couldn't allocate memory for sigma0, can't continue...\n" );
+		addr_space_set( addr_space_kernel( ));
+		return;
+	}
 
-	addr_space_insert_map( new_space, &ent );
 	debug_printf( "asdf: 0x%x\n", code_end );
-
 	memcpy( func, sigma0_addr, func_size );
 
 	thread_t *new_thread =
 		thread_create( func, new_space, new_stack, THREAD_FLAG_USER );
 
-	set_page_dir( page_get_kernel_dir( ));
+	addr_space_set( addr_space_kernel( ));
 
 	sched_add_thread( new_thread );
 }
@@ -173,6 +209,99 @@ multiboot_module_t *sigma0_find_module( multiboot_header_t *header ){
 
 #include <c4/mm/addrspace.h>
 
+// gets the end of a memory map entry, clipped to what fits in 32 bits
+static inline uintptr_t mem_map_end( multiboot_mem_map_t *ent ){
+	uintptr_t end = ent->addr_low + ent->len_low;
+
+	if ( ent->len_high || end < ent->addr_low ){
+		end = 0xfffff000;
+	}
+
+	return end;
+}
+
+static inline multiboot_mem_map_t *mem_map_next( multiboot_mem_map_t *ent ){
+	return (void *)((uintptr_t)ent + ent->size + sizeof( ent->size ));
+}
+
+enum {
+	// lowest 4MB is mapped in entry.s, and holds the kernel and early heap
+	PHYS_BOOT_MAPPED_END = 0x400000,
+};
+
+static void add_usable_range( uintptr_t start, uintptr_t end ){
+	if ( start < PHYS_BOOT_MAPPED_END ){
+		start = PHYS_BOOT_MAPPED_END;
+	}
+
+	if ( start < end ){
+		phys_add_range( start, end );
+	}
+}
+
+// sizes the physical page allocator using the memory map from the
+// bootloader, falling back to mem_upper if there isn't one
+static void init_phys_memory( multiboot_header_t *header ){
+	multiboot_mem_map_t *mmap_start = NULL;
+	multiboot_mem_map_t *mmap_end   = NULL;
+	multiboot_mem_map_t *ent;
+	uintptr_t mem_end = 0;
+
+	if ( header->flags & MULTIBOOT_FLAG_MMAP ){
+		mmap_start = (void *)low_phys_to_virt( header->mmap_addr );
+		mmap_end   = (void *)low_phys_to_virt( header->mmap_addr
+		                                       + header->mmap_length );
+	}
+
+	// first find the highest usable address, to size the bitmaps
+	for ( ent = mmap_start; ent < mmap_end; ent = mem_map_next( ent )){
+		if ( ent->type == MULTIBOOT_MEM_AVAILABLE && !ent->addr_high
+		     && mem_map_end( ent ) > mem_end )
+		{
+			mem_end = mem_map_end( ent );
+		}
+	}
+
+	if ( !mmap_start ){
+		mem_end = (header->flags & MULTIBOOT_FLAG_MEM)
+			? 0x100000 + header->mem_upper * 1024
+			: 0x800000;
+	}
+
+	phys_init( mem_end );
+
+	// then add every available range, anything not listed stays reserved
+	for ( ent = mmap_start; ent < mmap_end; ent = mem_map_next( ent )){
+		debug_printf( "    mmap: 0x%x -> 0x%x, type %u\n",
+		              ent->addr_low, mem_map_end( ent ), ent->type );
+
+		if ( ent->type == MULTIBOOT_MEM_AVAILABLE && !ent->addr_high ){
+			add_usable_range( ent->addr_low, mem_map_end( ent ));
+		}
+	}
+
+	if ( !mmap_start ){
+		add_usable_range( 0x100000, mem_end );
+	}
+
+	// don't hand out memory that modules were loaded into
+	if ( header->flags & MULTIBOOT_FLAG_MODS ){
+		multiboot_module_t *mods =
+			(void *)low_phys_to_virt( header->mods_addr );
+
+		for ( unsigned i = 0; i < header->mods_count; i++ ){
+			uintptr_t start = mods[i].start & ~(PAGE_SIZE - 1);
+			uintptr_t end   = (mods[i].end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+			phys_reserve_range( start, end );
+		}
+	}
+
+	debug_printf( "    %uKB usable, %uKB free\n",
+	              phys_total_pages( ) * (PAGE_SIZE / 1024),
+	              phys_free_pages( )  * (PAGE_SIZE / 1024));
+}
+
 void arch_init( multiboot_header_t *header ){
 	debug_puts( ">> Booting C4 kernel\n" );
 	debug_puts( "Initializing GDT... " );
@@ -187,12 +316,25 @@ void arch_init( multiboot_header_t *header ){
 	init_interrupts( );
 	debug_puts( "done\n" );
 
+	debug_puts( "Initializing debug output... " );
+	init_debug_output( );
+	debug_puts( "done\n" );
+
+	debug_puts( "Initializing FPU... " );
+	init_fpu( );
+	debug_puts( "done\n" );
+
 	debug_puts( "Initializing more paging structures... ");
 	init_paging( );
 	debug_puts( "done\n" );
 
+	debug_puts( "Initializing physical memory...\n" );
+	init_phys_memory( header );
+	debug_puts( "done\n" );
+
 	debug_puts( "Initializing kernel region... " );
-	region_init_global( (void *)(KERNEL_BASE + 0x400000) );
+	region_init_global( (void *)KERNEL_HEAP_BASE,
+	                    (KERNEL_HEAP_END - KERNEL_HEAP_BASE) / PAGE_SIZE );
 	debug_puts( "done\n" );
 
 	debug_puts( "Initializing address space structures..." );
@@ -4,6 +4,7 @@
 #include <c4/klib/string.h>
 #include <c4/debug.h>
 #include <c4/interrupts.h>
+#include <c4/scheduler.h>
 #include <stdbool.h>
 
 static interrupt_gate_t intr_table[256];
@@ -65,6 +66,7 @@ static void gen_protect_fault( interrupt_frame_t *frame ){
 	debug_printf( "=== error: 0b%b ===\n", frame->error_num );
 
 	interrupt_print_frame( frame );
+	debug_flush( );
 
 	for (;;);
 }
@@ -74,6 +76,7 @@ static void double_fault_handler( interrupt_frame_t *frame ){
 	debug_printf( "=== error: 0b%b ===\n", frame->error_num );
 
 	interrupt_print_frame( frame );
+	debug_flush( );
 
 	for (;;);
 }
@@ -120,6 +123,14 @@ void isr_dispatch( interrupt_frame_t *frame ){
 		debug_printf( "have unhandled interrupt %u, call %u\n",
 		              frame->intr_num, intr_stats[frame->intr_num] );
 	}
+
+	// switch now if the handler woke up a higher priority thread, so
+	// real-time driver threads don't have to wait for the next timer tick.
+	// only when coming from user mode though, a fault taken in the middle
+	// of a syscall is still using the shared kernel stack.
+	if ( frame->cs & 3 ){
+		sched_preempt_check( );
+	}
 }
 
 #include <c4/arch/pic.h>
@@ -12,3 +12,4 @@ k-obj += arch/x86/thread.o
 k-obj += arch/x86/scheduler.o
 k-obj += arch/x86/ringswitch.o
 k-obj += arch/x86/syscall.o
+k-obj += arch/x86/fpu.o
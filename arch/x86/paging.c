@@ -1,19 +1,19 @@
 #include <c4/arch/paging.h>
 #include <c4/paging.h>
 #include <c4/debug.h>
-#include <c4/klib/bitmap.h>
+#include <c4/mm/phys.h>
 #include <c4/arch/earlyheap.h>
 #include <c4/arch/interrupts.h>
+#include <c4/arch/segments.h>
+#include <c4/klib/string.h>
 #include <c4/common.h>
 
 #define NULL ((void *)0)
 
 extern page_dir_t boot_page_dir;
 static page_dir_t *kernel_page_dir;
-
-static bitmap_ent_t *phys_page_bitmap;
-unsigned avail_pages = 0;
-unsigned first_free = 0;
+// number of page tables allocated after boot, for memory statistics
+static unsigned page_tables = 0;
 
 // translate generic page flags to x86-specific ones
 static inline unsigned page_flags( page_flags_t flags ){
@@ -26,6 +26,20 @@ static inline void *add_page_flags( void *addr, page_flags_t flags ){
 	return (void *)((uintptr_t)addr | page_flags(flags));
 }
 
+enum {
+	CR0_WRITE_PROTECT      = 1 << 16,
+	CR4_PAGE_GLOBAL_ENABLE = 1 << 7,
+
+	PAGE_TABLE_ENTRIES = PAGE_SIZE / sizeof( page_table_t ),
+	// invalidating more pages than this at once flushes the whole TLB
+	// instead, past this point the invlpgs cost more than refilling it
+	PAGE_FLUSH_THRESHOLD = 32,
+};
+
+// holds a page while it's being copied for copy on write
+static uint8_t cow_scratch[PAGE_SIZE];
+
+// note that this leaves global entries in the TLB
 static inline void flush_tlb( void ){
 	asm volatile (
 		"mov %cr3, %eax;"
@@ -33,76 +47,46 @@ static inline void flush_tlb( void ){
 	);
 }
 
-static inline void invalidate_page( void *paddr ){
-	asm volatile ( "invlpg %0" :: "m"(paddr) );
+static inline void invalidate_page( void *vaddr ){
+	asm volatile ( "invlpg (%0)" :: "r"(vaddr) : "memory" );
 }
 
-// TODO: parse multiboot structure to get available memory regions
-//       for now assume the machine has 8MB of linear physical memory
-static void *init_page_bitmap( void ){
-	unsigned npages = 2048;
-	phys_page_bitmap = kealloc( npages / 8 );
+// toggling CR4.PGE flushes the whole TLB, global entries included
+void page_flush_global( void ){
+	uint32_t cr4;
 
-	// lowest 4MB is mapped in entry.s
-	for ( unsigned i = 0; i < 1024; i++ ){
-		bitmap_set( phys_page_bitmap, i );
-	}
-
-	avail_pages = npages - 1024;
-
-	return phys_page_bitmap;
+	asm volatile ( "mov %%cr4, %0" : "=r"(cr4));
+	asm volatile ( "mov %0, %%cr4" :: "r"(cr4 & ~CR4_PAGE_GLOBAL_ENABLE));
+	asm volatile ( "mov %0, %%cr4" :: "r"(cr4) : "memory" );
 }
 
-// TODO: maybe look into more efficient method for page allocation,
-//       using a bitmap is O(n) in the worst case. With heavy physical
-//       fragmentation it might become a performance problem.
-static void *alloc_phys_page( void ){
-	if ( avail_pages == 0 ){
-		return NULL;
-	}
-
-	unsigned i = first_free;
-	unsigned offset;
-
-	for ( i = 0; phys_page_bitmap[i] == BITMAP_ENT_FULL; i++ );
-	for ( offset = 0; phys_page_bitmap[i] & (1 << offset); offset++ );
-
-	uintptr_t real = i * BITMAP_BPS + offset;
-
-	bitmap_set( phys_page_bitmap, real );
-
-	first_free = i;
-	avail_pages--;
+// invalidates the pages in [start, end), or everything if there are too
+// many of them. global entries only need the full flush if the range
+// reaches kernel memory.
+static void page_invalidate_range( uintptr_t start, uintptr_t end ){
+	if ( (end - start) / PAGE_SIZE > PAGE_FLUSH_THRESHOLD ){
+		if ( is_kernel_address( (void *)(end - PAGE_SIZE) )){
+			page_flush_global( );
 
-	return (void *)(real * PAGE_SIZE);
-}
-
-static void free_phys_page( void *addr ){
-	uintptr_t temp = (uintptr_t)addr / PAGE_SIZE;
-	unsigned pos = temp / BITMAP_BPS;
+		} else {
+			flush_tlb( );
+		}
 
-	bitmap_unset( phys_page_bitmap, temp );
-	avail_pages++;
+		return;
+	}
 
-	if ( pos < first_free ){
-		first_free = pos;
+	for ( uintptr_t addr = start; addr < end; addr += PAGE_SIZE ){
+		invalidate_page( (void *)addr );
 	}
 }
 
-// this function sets a range of physical memory as used,
-// in anticipation of a future mapping there so the memory
-// doesn't get used later
-//
-// it's optimized for the bitmap structure though, might be worth
-// considering a way that would work better with eg. a tree-based
-// physical page map
-void page_reserve_phys_range( uintptr_t start, uintptr_t end ){
-	uintptr_t index     = start / PAGE_SIZE;
-	uintptr_t end_index = end   / PAGE_SIZE;
+// single pages come from the hot page cache in src/mm/phys.c
+static void *alloc_phys_page( void ){
+	return (void *)phys_page_alloc( );
+}
 
-	for ( ; index < end_index; index++ ){
-		bitmap_set( phys_page_bitmap, index );
-	}
+static void free_phys_page( void *addr ){
+	phys_page_free( (uintptr_t)addr );
 }
 
 static page_table_t *page_current_table_entry( unsigned entry ){
@@ -130,18 +114,383 @@ static void *page_phys_addr( void *vaddress ){
 
 	if ( !ret ){
 		debug_printf( "warning: have vaddress %p without phys. page\n", vaddress );
+		debug_flush( );
 		for ( ;; );
 	}
 
 	return (void *)(ret & ~PAGE_ARCH_ACCESSED);
 }
 
+// directory entries from SMALL_SPACE_BASE up to the recursive mapping cover
+// memory that's shared between every page directory, small address spaces
+// and the kernel. the kernel directory holds the master copy of these
+// entries, other directories pick them up as they're needed.
+static inline bool page_dir_entry_is_shared( unsigned dirent ){
+	return dirent >= page_dir_entry( (void *)SMALL_SPACE_BASE )
+	    && dirent < 1023;
+}
+
+// makes a writable entry read-only, marking it to be copied on write
+static inline uint32_t entry_make_cow( uint32_t ent ){
+	if ( ent & PAGE_ARCH_WRITABLE ){
+		ent = (ent & ~PAGE_ARCH_WRITABLE) | PAGE_ARCH_COW;
+	}
+
+	return ent;
+}
+
+// restores write access to an entry made read-only by entry_make_cow()
+static inline uint32_t entry_clear_cow( uint32_t ent ){
+	return (ent & ~PAGE_ARCH_COW) | PAGE_ARCH_WRITABLE;
+}
+
+// gives the current directory its own copy of a page table shared copy on
+// write with other directories. the pages the table maps are shared by
+// both copies from then on, so they're made copy on write in each.
+// returns false if there wasn't memory for the copy.
+static bool page_dir_unshare_table( unsigned dirent ){
+	page_dir_t *dir     = current_page_dir( );
+	page_table_t *table = page_current_table_entry( dirent );
+	uintptr_t old       = dir[dirent] & ~PAGE_ARCH_ALL_FLAGS;
+
+	if ( !phys_frame_is_shared( old )){
+		// every other directory has made its own copy already
+		dir[dirent] = entry_clear_cow( dir[dirent] );
+		flush_tlb( );
+		return true;
+	}
+
+	uintptr_t new = (uintptr_t)alloc_phys_page( );
+
+	if ( !new ){
+		return false;
+	}
+
+	// the table is written through the recursive mapping, which goes
+	// through this directory entry, so it has to be writable first
+	dir[dirent] = entry_clear_cow( dir[dirent] );
+	invalidate_page( table );
+
+	for ( unsigned i = 0; i < PAGE_SIZE / sizeof( page_table_t ); i++ ){
+		table[i] = entry_make_cow( table[i] );
+	}
+
+	memcpy( cow_scratch, table, PAGE_SIZE );
+	dir[dirent] = new | (dir[dirent] & PAGE_ARCH_ALL_FLAGS);
+	invalidate_page( table );
+	memcpy( table, cow_scratch, PAGE_SIZE );
+
+	phys_frame_unref( old );
+	page_tables++;
+	flush_tlb( );
+
+	return true;
+}
+
+// replaces a 4MB directory entry with a page table mapping the same memory
+// with the same permissions, so that part of it can be changed. returns
+// false if there wasn't memory for the table.
+static bool page_dir_split_large( unsigned dirent ){
+	page_dir_t *dir     = current_page_dir( );
+	page_table_t *table = page_current_table_entry( dirent );
+	uint32_t large      = dir[dirent];
+	uintptr_t base      = large & ~(PAGE_LARGE_SIZE - 1);
+	uint32_t flags      = large & PAGE_ARCH_ALL_FLAGS & ~PAGE_ARCH_4MB_ENTRY;
+	void *new           = alloc_phys_page( );
+
+	if ( !new ){
+		return false;
+	}
+
+	dir[dirent] = (page_dir_t)add_page_flags( new, PAGE_WRITE );
+	page_tables++;
+	invalidate_page( table );
+
+	for ( unsigned i = 0; i < PAGE_SIZE / sizeof( page_table_t ); i++ ){
+		table[i] = (base + i * PAGE_SIZE) | flags;
+	}
+
+	if ( large & PAGE_ARCH_GLOBAL ){
+		page_flush_global( );
+
+	} else {
+		flush_tlb( );
+	}
+
+	return true;
+}
+
+uintptr_t page_cow_fault( void *vaddr ){
+	unsigned dirent     = page_dir_entry( vaddr );
+	unsigned tableent   = page_table_entry( vaddr );
+	page_dir_t *dir     = current_page_dir( );
+	page_table_t *table = page_current_table_entry( dirent );
+	void *page          = (void *)((uintptr_t)vaddr & ~(PAGE_SIZE - 1));
+
+	if ( !(dir[dirent] & PAGE_ARCH_PRESENT)
+	  || page_dir_entry_is_shared( dirent ))
+	{
+		return 0;
+	}
+
+	// 4MB pages are copied a page at a time, the table entries from the
+	// split keep the copy on write marking
+	if ( dir[dirent] & PAGE_ARCH_4MB_ENTRY ){
+		if ( !(dir[dirent] & PAGE_ARCH_COW) || !page_dir_split_large( dirent )){
+			return 0;
+		}
+
+	} else if ( (dir[dirent] & PAGE_ARCH_COW)
+	            && !page_dir_unshare_table( dirent ))
+	{
+		return 0;
+	}
+
+	page_table_t ent = table[tableent];
+	uintptr_t old    = ent & ~PAGE_ARCH_ALL_FLAGS;
+
+	if ( !(dir[dirent] & PAGE_ARCH_WRITABLE) || !(ent & PAGE_ARCH_PRESENT) ){
+		return 0;
+	}
+
+	if ( !(ent & PAGE_ARCH_COW) ){
+		// the fault was on the directory entry, which unsharing fixed
+		return (ent & PAGE_ARCH_WRITABLE)? old : 0;
+	}
+
+	if ( phys_frame_is_shared( old )){
+		uintptr_t new = (uintptr_t)alloc_phys_page( );
+
+		if ( !new ){
+			return 0;
+		}
+
+		memcpy( cow_scratch, page, PAGE_SIZE );
+		table[tableent] = entry_clear_cow( new | (ent & PAGE_ARCH_ALL_FLAGS));
+		invalidate_page( page );
+		memcpy( page, cow_scratch, PAGE_SIZE );
+
+		phys_frame_unref( old );
+		return new;
+	}
+
+	// last reference, so the page can just be written in place
+	table[tableent] = entry_clear_cow( ent );
+	invalidate_page( page );
+
+	return old;
+}
+
+// makes sure a private directory entry has a page table of its own, which
+// can be changed without affecting anything else
+static bool page_dir_make_private( unsigned dirent ){
+	page_dir_t *dir = current_page_dir( );
+
+	if ( dir[dirent] & PAGE_ARCH_4MB_ENTRY ){
+		return page_dir_split_large( dirent );
+
+	} else if ( dir[dirent] & PAGE_ARCH_COW ){
+		return page_dir_unshare_table( dirent );
+	}
+
+	return true;
+}
+
+// installs a new, zeroed page table at the given directory entry, returns
+// false if there wasn't memory for it
+static bool page_dir_alloc_table( page_dir_t *dir, unsigned dirent ){
+	page_table_t *table = page_current_table_entry( dirent );
+	void *new           = alloc_phys_page( );
+
+	if ( !new ){
+		return false;
+	}
+
+	dir[dirent] = (page_table_t)add_page_flags( new, PAGE_WRITE );
+	page_tables++;
+	invalidate_page( table );
+	memset( table, 0, PAGE_SIZE );
+
+	return true;
+}
+
+// copies a shared directory entry from the kernel directory into the
+// current one, creating the page table in the kernel directory first if
+// 'create' is set. returns true if the current directory has the entry.
+static bool page_dir_sync_shared( unsigned dirent, bool create ){
+	page_dir_t *dir = current_page_dir( );
+
+	page_table_t *table = page_current_table_entry( dirent );
+
+	if ( !kernel_page_dir[dirent] && create ){
+		void *new = alloc_phys_page( );
+
+		if ( !new ){
+			return false;
+		}
+
+		// the new table is cleared through the current directory's
+		// recursive mapping, which works whether or not the current
+		// directory is the kernel directory
+		kernel_page_dir[dirent] = (page_table_t)add_page_flags( new, PAGE_WRITE );
+		dir[dirent] = kernel_page_dir[dirent];
+		page_tables++;
+
+		invalidate_page( table );
+		memset( table, 0, PAGE_SIZE );
+	}
+
+	if ( !dir[dirent] && kernel_page_dir[dirent] ){
+		dir[dirent] = kernel_page_dir[dirent];
+		invalidate_page( table );
+	}
+
+	return dir[dirent] != 0;
+}
+
+// returns the page table for a directory entry in the current directory,
+// creating it or making a private copy of it as needed so that entries
+// can be added. returns NULL if there wasn't memory for that.
+static page_table_t *page_dir_table_for_write( unsigned dirent ){
+	page_dir_t *dir = current_page_dir( );
+
+	bool ok;
+
+	if ( page_dir_entry_is_shared( dirent )){
+		ok = page_dir_sync_shared( dirent, true );
+
+	} else if ( !dir[dirent] ){
+		ok = page_dir_alloc_table( dir, dirent );
+
+	} else {
+		ok = page_dir_make_private( dirent );
+	}
+
+	return ok? page_current_table_entry( dirent ) : NULL;
+}
+
+static bool page_table_is_empty( page_table_t *table ){
+	for ( unsigned i = 0; i < PAGE_TABLE_ENTRIES; i++ ){
+		if ( table[i] ){
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// frees the page table at a private directory entry once nothing is
+// mapped through it. tables shared with the kernel directory stay.
+static void page_dir_free_empty_table( unsigned dirent ){
+	page_dir_t *dir     = current_page_dir( );
+	page_table_t *table = page_current_table_entry( dirent );
+
+	if ( page_dir_entry_is_shared( dirent )
+	  || dir[dirent] == kernel_page_dir[dirent]
+	  || !page_table_is_empty( table ))
+	{
+		return;
+	}
+
+	uintptr_t addr = dir[dirent] & ~PAGE_ARCH_ALL_FLAGS;
+
+	dir[dirent] = 0;
+	invalidate_page( table );
+	free_phys_page( (void *)addr );
+	page_tables--;
+}
+
+bool page_is_present( void *vaddress ){
+	unsigned dirent = page_dir_entry( vaddress );
+	page_dir_t *dir = current_page_dir( );
+
+	if ( page_dir_entry_is_shared( dirent ) && !dir[dirent] ){
+		page_dir_sync_shared( dirent, false );
+	}
+
+	if ( !(dir[dirent] & PAGE_ARCH_PRESENT) ){
+		return false;
+	}
+
+	if ( dir[dirent] & PAGE_ARCH_4MB_ENTRY ){
+		return true;
+	}
+
+	page_table_t *table = page_current_table_entry( dirent );
+
+	return table[page_table_entry( vaddress )] & PAGE_ARCH_PRESENT;
+}
+
+bool page_dir_prealloc_shared( void *start, void *end ){
+	unsigned first = page_dir_entry( start );
+	unsigned last  = page_dir_entry( (uint8_t *)end - 1 );
+
+	for ( unsigned dirent = first; dirent <= last; dirent++ ){
+		KASSERT( page_dir_entry_is_shared( dirent ));
+
+		if ( !page_dir_sync_shared( dirent, true )){
+			return false;
+		}
+	}
+
+	return true;
+}
+
+#include <c4/mm/addrspace.h>
+#include <c4/message.h>
+#include <c4/scheduler.h>
+
 void page_fault_handler( interrupt_frame_t *frame ){
 	unsigned err = frame->error_num;
 	uint32_t cr_2;
 
 	asm volatile ( "mov %%cr2, %0" : "=r"(cr_2));
 
+	// writes to pages shared copy on write, either from user code or
+	// from the kernel writing to user memory
+	if ( (err & PAGE_ARCH_PRESENT) && (err & PAGE_ARCH_WRITABLE)
+	     && addr_space_cow_fault( addr_space_active( ), cr_2 ))
+	{
+		return;
+	}
+
+	// the faulting directory might just be missing a shared table that
+	// was created after it was cloned
+	if ( !(err & PAGE_ARCH_PRESENT) ){
+		unsigned dirent = page_dir_entry( (void *)cr_2 );
+		page_dir_t *dir = current_page_dir( );
+
+		if ( page_dir_entry_is_shared( dirent ) && !dir[dirent]
+		     && page_dir_sync_shared( dirent, false ))
+		{
+			return;
+		}
+	}
+
+	// anything else from user mode goes to the thread's pager, which
+	// doesn't return unless the thread doesn't have one
+	if ( err & PAGE_ARCH_SUPERVISOR ){
+		unsigned flags = 0;
+
+		flags |= (err & PAGE_ARCH_WRITABLE)? MESSAGE_PAGE_FAULT_WRITE   : 0;
+		flags |= (err & PAGE_ARCH_PRESENT)?  MESSAGE_PAGE_FAULT_PRESENT : 0;
+
+		message_send_page_fault( cr_2, flags, frame->eip );
+
+	// the kernel touching user memory for a syscall, which faults the
+	// buffer in first. the thread's memory changed under it somehow, so
+	// get rid of the thread rather than the kernel. any other kernel
+	// fault is a bug, and gets the dump below.
+	} else if ( is_user_address( (void *)cr_2 )
+	            && (sched_current_thread( )->flags & SCHED_FLAG_USER_ACCESS))
+	{
+		sched_current_thread( )->flags &= ~SCHED_FLAG_USER_ACCESS;
+		debug_log( DEBUG_LEVEL_ERROR,
+		           "thread %u: kernel fault on user address %p, exiting\n",
+		           sched_current_thread( )->id, cr_2 );
+		sched_thread_exit( );
+	}
+
 	debug_printf( "=== page fault! ===\n" );
 	debug_printf( "=== fault address: %p\n", cr_2 );
 	debug_printf( "=== error code: 0b%b ===\n", frame->error_num );
@@ -152,12 +501,14 @@ void page_fault_handler( interrupt_frame_t *frame ){
 	);
 
 	interrupt_print_frame( frame );
+	debug_flush( );
 
 	for ( ;; );
 }
 
 void init_paging( void ){
 	kernel_page_dir = &boot_page_dir;
+	page_dir_load_phys( low_virt_to_phys((uintptr_t)kernel_page_dir ));
 
 	// set up recursive mapping
 	kernel_page_dir[1023] =
@@ -167,55 +518,209 @@ void init_paging( void ){
 		//| PAGE_ARCH_SUPERVISOR
 		;
 
-	register_interrupt( INTERRUPT_PAGE_FAULT, page_fault_handler );
+	// have the kernel fault on read-only pages too, so its writes to
+	// user memory shared copy on write get copied
+	uint32_t cr0;
+	asm volatile ( "mov %%cr0, %0" : "=r"(cr0));
+	asm volatile ( "mov %0, %%cr0" :: "r"(cr0 | CR0_WRITE_PROTECT));
 
-	init_page_bitmap( );
+	register_interrupt( INTERRUPT_PAGE_FAULT, page_fault_handler );
 	debug_printf( " (%p)\n", kernel_page_dir );
 }
 
 void *map_page( unsigned perms, void *vaddr ){
 	void *raddr = alloc_phys_page( );
 
-	return map_phys_page( perms, vaddr, raddr );
+	if ( !raddr ){
+		return NULL;
+	}
+
+	if ( !map_phys_page( perms, vaddr, raddr )){
+		free_phys_page( raddr );
+		return NULL;
+	}
+
+	return vaddr;
 }
 
+// goes through the range code so that a replaced entry gets invalidated
 void *map_phys_page( unsigned perms, void *vaddr, void *raddr ){
-	unsigned dirent   = page_dir_entry( vaddr );
-	unsigned tableent = page_table_entry( vaddr );
+	return map_phys_range( perms, vaddr, raddr, 1 )? vaddr : NULL;
+}
 
-	page_dir_t *dir     = current_page_dir( );
-	page_table_t *table = page_current_table_entry( dirent );
+// maps a whole directory entry as one 4MB page, if both addresses are
+// aligned and the entry is private and unused
+static bool map_phys_large_page( unsigned perms, void *vaddr, void *raddr ){
+	unsigned dirent = page_dir_entry( vaddr );
+	page_dir_t *dir = current_page_dir( );
+
+	// shared entries need their tables to stay the same in every directory
+	if ( ((uintptr_t)vaddr | (uintptr_t)raddr) & (PAGE_LARGE_SIZE - 1)
+	  || page_dir_entry_is_shared( dirent )
+	  || dir[dirent] )
+	{
+		return false;
+	}
 
-	if ( !dir[dirent] ){
-		dir[dirent] =
-			(page_table_t)add_page_flags( alloc_phys_page( ), PAGE_WRITE );
+	dir[dirent] = (page_dir_t)add_page_flags( raddr, perms )
+	            | PAGE_ARCH_4MB_ENTRY;
+
+	if ( is_kernel_address( vaddr )){
+		dir[dirent] |= PAGE_ARCH_GLOBAL;
 	}
 
-	table[tableent] = (page_table_t)add_page_flags( raddr, perms );
+	return true;
+}
 
-	return (void *)vaddr;
+bool map_phys_range( unsigned perms, void *vaddr, void *raddr, unsigned pages ){
+	uintptr_t virt  = (uintptr_t)vaddr;
+	uintptr_t phys  = (uintptr_t)raddr;
+	// range of entries that were replaced, and might be in the TLB
+	uintptr_t stale_start = 0;
+	uintptr_t stale_end   = 0;
+	bool ret = true;
+
+	// one page table's worth at a time, so the directory lookup and any
+	// table allocation only happen once per 4MB
+	while ( pages > 0 ){
+		unsigned dirent   = page_dir_entry( (void *)virt );
+		unsigned tableent = page_table_entry( (void *)virt );
+		unsigned count    = PAGE_TABLE_ENTRIES - tableent;
+
+		if ( count > pages ){
+			count = pages;
+		}
+
+		if ( count < PAGE_TABLE_ENTRIES
+		  || !map_phys_large_page( perms, (void *)virt, (void *)phys ))
+		{
+			page_table_t *table = page_dir_table_for_write( dirent );
+			page_table_t ent    = (page_table_t)add_page_flags( (void *)phys, perms );
+
+			if ( !table ){
+				ret = false;
+				break;
+			}
+
+			// kernel mappings are the same in every address space, so
+			// keep them in the TLB across page directory switches
+			if ( is_kernel_address( (void *)virt )){
+				ent |= PAGE_ARCH_GLOBAL;
+			}
+
+			for ( unsigned i = 0; i < count; i++ ){
+				if ( table[tableent + i] & PAGE_ARCH_PRESENT ){
+					uintptr_t addr = virt + i * PAGE_SIZE;
+
+					stale_start = stale_end? stale_start : addr;
+					stale_end   = addr + PAGE_SIZE;
+				}
+
+				table[tableent + i] = ent + i * PAGE_SIZE;
+			}
+		}
+
+		virt  += count * PAGE_SIZE;
+		phys  += count * PAGE_SIZE;
+		pages -= count;
+	}
+
+	if ( stale_end ){
+		page_invalidate_range( stale_start, stale_end );
+	}
+
+	return ret;
 }
 
-void unmap_page( void *vaddress ){
-	unsigned dirent   = page_dir_entry( vaddress );
-	unsigned tableent = page_table_entry( vaddress );
+// clears the entries for a range of pages, freeing the pages themselves if
+// 'free_pages' is set, and any page tables left empty. the TLB is
+// invalidated once at the end, rather than page by page.
+static void page_unmap_range( void *vaddr, unsigned pages, bool free_pages ){
+	page_dir_t *dir = current_page_dir( );
+	uintptr_t virt  = (uintptr_t)vaddr;
+	uintptr_t stale_start = 0;
+	uintptr_t stale_end   = 0;
+
+	while ( pages > 0 ){
+		unsigned dirent   = page_dir_entry( (void *)virt );
+		unsigned tableent = page_table_entry( (void *)virt );
+		unsigned count    = PAGE_TABLE_ENTRIES - tableent;
+		uintptr_t next;
+
+		if ( count > pages ){
+			count = pages;
+		}
 
-	page_dir_t *dir       = current_page_dir( );
-	page_table_t *table   = page_current_table_entry( dirent );
+		next = virt + count * PAGE_SIZE;
 
-	if ( dir[dirent] ){
-		if ( table[tableent] ){
-			// TODO: check to see if table is entirely empty,
-			//       and free the table if so
-			void *paddr = (void *)table[tableent];
-
-			table[tableent] = 0;
-			invalidate_page( paddr );
-			free_phys_page( paddr );
+		if ( page_dir_entry_is_shared( dirent )){
+			page_dir_sync_shared( dirent, false );
+
+		} else if ( (dir[dirent] & PAGE_ARCH_4MB_ENTRY)
+		            && count == PAGE_TABLE_ENTRIES && !free_pages )
+		{
+			// a whole large page goes, no need to split it first
+			dir[dirent] = 0;
+			stale_start = stale_end? stale_start : virt;
+			stale_end   = next;
+
+		} else if ( !page_dir_make_private( dirent )){
+			debug_log( DEBUG_LEVEL_ERROR,
+			           "couldn't copy page table to unmap %p\n", (void *)virt );
+			break;
 		}
+
+		if ( dir[dirent] ){
+			page_table_t *table = page_current_table_entry( dirent );
+			bool cleared = false;
+
+			for ( unsigned i = tableent; i < tableent + count; i++ ){
+				if ( !table[i] ){
+					continue;
+				}
+
+				if ( free_pages ){
+					free_phys_page( (void *)(table[i] & ~PAGE_ARCH_ALL_FLAGS));
+				}
+
+				table[i] = 0;
+				cleared  = true;
+			}
+
+			if ( cleared ){
+				stale_start = stale_end? stale_start : virt;
+				stale_end   = next;
+				page_dir_free_empty_table( dirent );
+			}
+		}
+
+		virt   = next;
+		pages -= count;
+	}
+
+	if ( stale_end ){
+		page_invalidate_range( stale_start, stale_end );
 	}
 }
 
+void unmap_page( void *vaddress ){
+	page_unmap_range( vaddress, 1, true );
+}
+
+// removes a mapping without freeing the physical page behind it, for
+// mappings made with map_phys_page()
+void unmap_phys_page( void *vaddress ){
+	page_unmap_range( vaddress, 1, false );
+}
+
+void unmap_range( void *vaddr, unsigned pages ){
+	page_unmap_range( vaddr, pages, true );
+}
+
+void unmap_phys_range( void *vaddr, unsigned pages ){
+	page_unmap_range( vaddr, pages, false );
+}
+
 page_dir_t *current_page_dir( void ){
 	// TODO: read cr3
 	return (page_dir_t *)0xfffff000;
@@ -233,13 +738,32 @@ page_dir_t *page_dir_current_phys( void ){
 	return ret;
 }
 
-void set_page_dir( page_dir_t *dir ){
-	uintptr_t addr = (uintptr_t)page_phys_addr( dir );
-	addr |= PAGE_ARCH_PRESENT | PAGE_ARCH_WRITABLE;
+// every directory maps itself in its last entry, so the physical address
+// can be read from there instead of walking the current page tables
+uintptr_t page_dir_phys_addr( page_dir_t *dir ){
+	return dir[1023] & ~PAGE_ARCH_ALL_FLAGS;
+}
+
+// physical address of the directory in CR3, as of the last load
+static uintptr_t loaded_dir_phys = 0;
+
+void page_dir_load_phys( uintptr_t addr ){
+	if ( addr != loaded_dir_phys ){
+		asm volatile ( "mov %0, %%cr3" :: "r"(addr) : "memory" );
+		loaded_dir_phys = addr;
+	}
+}
 
-	//debug_printf( "new page dir is at %p\n", addr );
+uintptr_t page_dir_loaded_phys( void ){
+	return loaded_dir_phys;
+}
 
-	asm volatile ( "mov %0, %%cr3" :: "r"(addr) );
+void page_set_user_window( uintptr_t base, uintptr_t size ){
+	segment_set_user_window( base, size );
+}
+
+void set_page_dir( page_dir_t *dir ){
+	page_dir_load_phys( page_dir_phys_addr( dir ));
 }
 
 // placed down here so that region allocations don't get used absent-mindedly
@@ -250,14 +774,70 @@ page_dir_t *clone_page_dir( page_dir_t *dir ){
 	KASSERT( region_global_is_inited( ));
 
 	page_dir_t *newdir = region_alloc( region_get_global( ));
+	unsigned user_end  = page_dir_entry( (void *)SMALL_SPACE_BASE );
+	bool shared        = false;
+
 	KASSERT( newdir != NULL );
 
 	for ( unsigned i = 0; i < 1023; i++ ){
+		// private page tables are shared copy on write, and only copied
+		// once one of the directories writes through them. 4MB pages
+		// are split into a table on the first write.
+		if ( i < user_end && dir[i] && dir[i] != kernel_page_dir[i] ){
+			dir[i] = entry_make_cow( dir[i] );
+			shared = true;
+
+			if ( !(dir[i] & PAGE_ARCH_4MB_ENTRY)){
+				phys_frame_ref( dir[i] & ~PAGE_ARCH_ALL_FLAGS );
+			}
+		}
+
 		newdir[i] = dir[i] & ~PAGE_ARCH_ACCESSED;
 	}
 
-	// set up recursive mapping for the directory
-	newdir[1023] = (page_table_t)page_phys_addr( newdir );
+	// the old directory lost write access to its tables
+	uintptr_t current = (uintptr_t)page_dir_current_phys( );
+
+	if ( shared && page_dir_phys_addr( dir ) == current ){
+		flush_tlb( );
+	}
+
+	// set up recursive mapping for the directory. this one is never global,
+	// since what it maps differs between address spaces
+	newdir[1023] = ((uintptr_t)page_phys_addr( newdir ) & ~PAGE_ARCH_ALL_FLAGS)
+	             | PAGE_ARCH_PRESENT
+	             | PAGE_ARCH_WRITABLE;
 
 	return newdir;
 }
+
+// frees the page tables for the private, user part of a directory which
+// isn't loaded anymore. tables shared with the kernel directory are left
+// alone, as are the pages they map, which belong to the address space's
+// map entries. tables shared copy on write with other directories are
+// freed along with the last of them.
+void page_dir_free_user_tables( page_dir_t *dir ){
+	unsigned end = page_dir_entry( (void *)SMALL_SPACE_BASE );
+
+	for ( unsigned i = 0; i < end; i++ ){
+		if ( !dir[i]
+		  || (dir[i] & PAGE_ARCH_4MB_ENTRY)
+		  || dir[i] == kernel_page_dir[i] )
+		{
+			continue;
+		}
+
+		uintptr_t table = dir[i] & ~PAGE_ARCH_ALL_FLAGS;
+
+		if ( phys_frame_unref( table )){
+			free_phys_page( (void *)table );
+			page_tables--;
+		}
+
+		dir[i] = 0;
+	}
+}
+
+unsigned page_table_count( void ){
+	return page_tables;
+}
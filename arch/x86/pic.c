@@ -35,3 +35,15 @@ void clear_pic_interrupt( void ){
 	outb( PIC_MASTER | PIC_COMMAND, PIC_COM_END_OF_INTR );
 	outb( PIC_SLAVE  | PIC_COMMAND, PIC_COM_END_OF_INTR );
 }
+
+void pic_unmask_irq( unsigned irq ){
+	unsigned port = (irq < 8)? PIC_MASTER : PIC_SLAVE;
+	uint8_t  mask = inb( port | PIC_DATA );
+
+	outb( port | PIC_DATA, mask & ~(1 << (irq % 8)));
+
+	// irqs on the slave come in through the master's cascade line
+	if ( irq >= 8 ){
+		pic_unmask_irq( 2 );
+	}
+}
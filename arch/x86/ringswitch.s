@@ -30,3 +30,14 @@ usermode_jump:
     push dword eax
 
     iret                                   ;; and return
+
+global usermode_return
+;; returns to user mode through an interrupt frame at the top of the stack,
+;; the same way isr_common in idt.s does. used to resume user threads, which
+;; don't keep any other state on the kernel stack while switched out.
+usermode_return:
+    SET_DATA_SELECTORS selector( 4, GDT, ring(3) ) ;; see segments.c
+
+    popa
+    add esp, 8
+    iret
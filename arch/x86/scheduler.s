@@ -4,12 +4,15 @@ get_eip:
     mov eax, [esp]
     ret
 
-;; usermode_jump defined in ringswitch.s
-extern usermode_jump
+;; usermode_return defined in ringswitch.s
+extern usermode_return
+;; thread_resume_user defined in thread.c
+extern thread_resume_user
 
 global sched_do_thread_switch
 ;; esp+4: thread_t structure of current thread, which will
-;;        be saved in a way that can be resumed later
+;;        be saved in a way that can be resumed later. zero if there's
+;;        nothing to save, as with user threads
 ;; esp+8: next thread, which needs to be loaded
 sched_do_thread_switch:
     cli
@@ -35,11 +38,11 @@ sched_do_thread_switch:
     ; load second argument from stack
     mov edx, [esi + 8]
 
-    ; test to see if this thread needs to be switched to usermode,
-    ; and if so, do that instead of restoring state here
+    ; user threads are resumed through their interrupt frame instead,
+    ; see resume_frame in thread_regs_t
     mov  eax, [edx + 12]
     test eax, eax
-    jnz .do_usermode_switch
+    jnz .resume_user
 
     ; load ebp, esp and eip, and jump to new eip
     mov ebp, [edx + 0]
@@ -48,19 +51,17 @@ sched_do_thread_switch:
     sti
     jmp ebx
 
-.do_usermode_switch:
-    mov [edx + 12], dword 0
+.resume_user:
+    ; the thread's frame has already been copied to the top of the per-cpu
+    ; kernel stack, so continue right below it. whatever was on the stack
+    ; before belonged to a thread that doesn't need it anymore.
+    mov esp, eax
 
-    ; push stack argument (esp)
-    mov eax, [edx + 4]
-    push eax
-
-    ; push entry argument (eip)
-    mov eax, [edx + 8]
-    push eax
-
-    push dword 0
-    jmp usermode_jump
+    ; run the thread's continuation, if it has one, then return to user mode
+    push edx
+    call thread_resume_user
+    add esp, 4
+    jmp usermode_return
 
 .finished:
     ; restore state when resuming from previous thread switch
@@ -42,6 +42,11 @@ static inline void define_task_descriptor( task_state_desc_t *desc,
 }
 
 static inline void init_task_segment( task_seg_t *seg ){
+	// kernel stack used whenever user code enters the kernel, this is shared
+	// by every user thread. see sched_thread_block() for how blocking works
+	// without a stack per thread.
+	//
+	// TODO: this will need to be per-cpu once SMP is working
 	static unsigned kernel_stack[1024];
 
 	seg->ss_p0  = selector( 2, SEG_TABLE_GDT, ring(0) );
@@ -55,19 +60,36 @@ static inline void init_task_segment( task_seg_t *seg ){
 	seg->iomap_base = 0xffff;
 }
 
-static task_seg_t task_seg;
-
-void kernel_stack_set( void *addr ){
-	task_seg.esp_p0 = (uint32_t)addr;
-}
+static task_seg_t     task_seg;
+static segment_desc_t descripts[6];
 
 void *kernel_stack_get( void ){
 	return (void *)task_seg.esp_p0;
 }
 
+// sets the base and size (in bytes, page granularity) of the user code
+// and data segments. the new values are picked up the next time user
+// selectors are loaded, which happens on every return to user mode.
+void segment_set_user_window( uint32_t base, uint32_t size ){
+	static uint32_t cur_base = 0;
+	static uint32_t cur_size = 0;
+
+	if ( base == cur_base && size == cur_size ){
+		return;
+	}
+
+	define_descriptor( descripts + 3, base, (size >> 12) - 1,
+	                   SEG_CODE | SEG_CODE_READ, ring(3));
+
+	define_descriptor( descripts + 4, base, (size >> 12) - 1,
+	                   SEG_DATA | SEG_DATA_WRITE, ring(3));
+
+	cur_base = base;
+	cur_size = size;
+}
+
 void init_segment_descs( void ){
-	static gdt_ptr_t      gdt;
-	static segment_desc_t descripts[6];
+	static gdt_ptr_t gdt;
 
 	memset( &descripts, 0, sizeof( segment_desc_t[6] ));
     memset( &task_seg,  0, sizeof( task_seg ));
@@ -1,11 +1,29 @@
 #include <c4/arch/thread.h>
+#include <c4/arch/segments.h>
 #include <c4/thread.h>
 #include <c4/debug.h>
 #include <c4/common.h>
 #include <c4/klib/string.h>
-#include <c4/mm/region.h>
 #include <c4/scheduler.h>
 
+enum {
+	EFLAGS_RESERVED          = 1 << 1,
+	EFLAGS_ENABLE_INTERRUPTS = 1 << 9,
+
+	// syscalls are made with 'int $0x60'
+	SYSCALL_INSTRUCTION_SIZE = 2,
+};
+
+// user threads always enter the kernel at the top of the per-cpu kernel
+// stack, set in the TSS, so that's where their interrupt frame is
+//
+// TODO: this will need to be per-cpu once SMP is working
+static inline interrupt_frame_t *user_frame( void ){
+	uintptr_t top = (uintptr_t)kernel_stack_get( );
+
+	return (interrupt_frame_t *)(top - sizeof( interrupt_frame_t ));
+}
+
 void thread_set_init_state( thread_t *thread,
                             void (*entry)(void),
                             void *stack,
@@ -13,12 +31,60 @@ void thread_set_init_state( thread_t *thread,
 {
 	memset( thread, 0, sizeof( thread_t ));
 
-	uint8_t *kern_stack = region_alloc( region_get_global( ));
+	if ( flags & THREAD_FLAG_USER ){
+		// start the thread as if it were returning from an interrupt
+		interrupt_frame_t *frame = &thread->registers.user_frame;
+
+		frame->eip      = (uint32_t)entry;
+		frame->cs       = selector( 3, SEG_TABLE_GDT, ring(3) );
+		frame->eflags   = EFLAGS_RESERVED | EFLAGS_ENABLE_INTERRUPTS;
+		frame->user_esp = (uint32_t)stack;
+		frame->user_ss  = selector( 4, SEG_TABLE_GDT, ring(3) );
+
+		thread->registers.resume_frame = user_frame( );
+
+	} else {
+		thread->registers.esp = (uint32_t)stack;
+		thread->registers.eip = (uint32_t)entry;
+	}
+}
+
+void thread_save_user_state( thread_t *thread ){
+	thread->registers.user_frame = *user_frame( );
+}
+
+void thread_load_user_state( thread_t *thread ){
+	*user_frame( ) = thread->registers.user_frame;
+}
+
+// sets the value returned from the syscall the thread is in. the thread
+// has to be the current one, since its frame is only on the kernel stack
+// while it's running
+void thread_set_syscall_return( thread_t *thread, uintptr_t value ){
+	if ( thread->flags & THREAD_FLAG_USER ){
+		user_frame( )->eax = value;
+	}
+}
+
+uintptr_t thread_restart_syscall( thread_t *thread ){
+	interrupt_frame_t *frame = user_frame( );
+
+	// the syscall number is still in eax, since the return value is only
+	// stored there once the syscall finishes
+	if ( thread->flags & THREAD_FLAG_USER ){
+		frame->eip -= SYSCALL_INSTRUCTION_SIZE;
+	}
+
+	return frame->eip;
+}
 
-	KASSERT( kern_stack != NULL );
+// called from sched_do_thread_switch() in scheduler.s on the per-cpu kernel
+// stack, right before a user thread returns to user mode
+void thread_resume_user( thread_t *thread ){
+	thread_cont_t cont = thread->continuation;
 
-	thread->kernel_stack  = kern_stack + PAGE_SIZE;
-	thread->registers.esp = (uint32_t)stack;
-	thread->registers.eip = (uint32_t)entry;
-	thread->registers.do_user_switch = !!(flags & THREAD_FLAG_USER);
+	if ( cont ){
+		thread->continuation = NULL;
+		cont( thread );
+	}
 }
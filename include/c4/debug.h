@@ -5,7 +5,8 @@
 #ifndef KNDEBUG
 #define KASSERT(CONDITION) { \
 		if ( !(CONDITION) ){ \
-			debug_printf( "%s:%u: assertion \"" #CONDITION "\" failed\n", \
+			debug_log( DEBUG_LEVEL_ERROR, \
+				"%s:%u: assertion \"" #CONDITION "\" failed\n", \
 				__FILE__, __LINE__ ); \
 		} \
 	}
@@ -14,8 +15,37 @@
 #define KASSERT(CONDITION) /* CONDITION */
 #endif
 
+// messages below the current level are dropped before being formatted,
+// debug_printf() logs at DEBUG_LEVEL_INFO
+enum {
+	DEBUG_LEVEL_TRACE,
+	DEBUG_LEVEL_INFO,
+	DEBUG_LEVEL_WARN,
+	DEBUG_LEVEL_ERROR,
+};
+
+enum {
+	// size of the in-memory log ring, must be a power of two
+	DEBUG_RING_SIZE = 16384,
+	// longest single message, longer ones are truncated
+	DEBUG_LINE_MAX  = 256,
+};
+
 void debug_putchar( int c );
 void debug_puts( const char *str );
 void debug_printf( const char *format, ... );
+void debug_log( unsigned level, const char *format, ... );
+void debug_set_level( unsigned level );
+
+// output is formatted into a ring buffer, and written out by the arch
+// code as the output device is ready for it. debug_ring_getchar() takes
+// the next character to write, or returns -1 if there isn't one.
+int  debug_ring_getchar( void );
+
+// implemented by the arch code, debug_output_kick() starts writing out
+// whatever is in the ring, debug_flush() doesn't return until everything
+// has been written, for use before halting on fatal errors
+void debug_output_kick( void );
+void debug_flush( void );
 
 #endif
@@ -12,6 +12,9 @@ enum {
 
 typedef uint32_t bitmap_ent_t;
 
+// number of sections needed to hold 'bits' bits
+#define BITMAP_WORDS(bits) (((bits) + BITMAP_BPS - 1) / BITMAP_BPS)
+
 static inline bool bitmap_get( bitmap_ent_t *bitmap, unsigned i ){
 	unsigned bitindex = i / BITMAP_BPS;
 	unsigned offset   = i % BITMAP_BPS;
@@ -35,14 +38,84 @@ static inline void bitmap_unset( bitmap_ent_t *bitmap, unsigned i ){
 	bitmap[bitindex] = bitvalue & ~(1 << offset);
 }
 
+// index of the lowest set bit, 'ent' must not be zero. compiles to a
+// single bsf instruction.
+static inline unsigned bitmap_ctz( bitmap_ent_t ent ){
+	return __builtin_ctz( ent );
+}
+
 static inline int bitmap_first_free( bitmap_ent_t *bitmap, unsigned limit ){
-	for ( unsigned i = 0; i < limit; i++ ){
-		if ( bitmap_get( bitmap, i ) == false ){
-			return i;
+	unsigned words = BITMAP_WORDS( limit );
+
+	for ( unsigned i = 0; i < words; i++ ){
+		if ( bitmap[i] != BITMAP_ENT_FULL ){
+			unsigned ret = i * BITMAP_BPS + bitmap_ctz( ~bitmap[i] );
+
+			return (ret < limit)? (int)ret : -1;
 		}
 	}
 
 	return -1;
 }
 
+// returns the first set bit in [start, end), or -1 if they're all clear
+int  bitmap_first_set( bitmap_ent_t *bitmap, unsigned start, unsigned end );
+
+void bitmap_set_range( bitmap_ent_t *bitmap, unsigned start, unsigned count );
+void bitmap_unset_range( bitmap_ent_t *bitmap, unsigned start, unsigned count );
+
+// returns the start of the first run of 'count' clear bits below 'limit',
+// or -1 if there isn't one
+int bitmap_first_free_run( bitmap_ent_t *bitmap, unsigned limit, unsigned count );
+// same as above, but the run has to start at a multiple of 'align'
+int bitmap_first_free_run_aligned( bitmap_ent_t *bitmap,
+                                   unsigned limit,
+                                   unsigned count,
+                                   unsigned align );
+// length of the longest run of clear bits below 'limit'
+unsigned bitmap_largest_free_run( bitmap_ent_t *bitmap, unsigned limit );
+
+// two level bitmap, a bit in 'summary' is set when the corresponding
+// section of 'map' is full. finding a free bit skips a whole summary
+// section of full words at a time, which keeps lookups fast as the
+// bitmap fills up.
+typedef struct hbitmap {
+	bitmap_ent_t *map;
+	bitmap_ent_t *summary;
+	unsigned      bits;
+} hbitmap_t;
+
+#define HBITMAP_SUMMARY_WORDS(bits) BITMAP_WORDS( BITMAP_WORDS( bits ))
+
+// 'map' needs BITMAP_WORDS(bits) sections, and 'summary' needs
+// HBITMAP_SUMMARY_WORDS(bits). every bit starts out clear.
+void hbitmap_init( hbitmap_t    *hbitmap,
+                   bitmap_ent_t *map,
+                   bitmap_ent_t *summary,
+                   unsigned      bits );
+
+int  hbitmap_first_free( hbitmap_t *hbitmap );
+int  hbitmap_first_free_run( hbitmap_t *hbitmap, unsigned count, unsigned align );
+void hbitmap_set_range( hbitmap_t *hbitmap, unsigned start, unsigned count );
+void hbitmap_unset_range( hbitmap_t *hbitmap, unsigned start, unsigned count );
+
+static inline bool hbitmap_get( hbitmap_t *hbitmap, unsigned i ){
+	return bitmap_get( hbitmap->map, i );
+}
+
+static inline void hbitmap_set( hbitmap_t *hbitmap, unsigned i ){
+	unsigned word = i / BITMAP_BPS;
+
+	bitmap_set( hbitmap->map, i );
+
+	if ( hbitmap->map[word] == BITMAP_ENT_FULL ){
+		bitmap_set( hbitmap->summary, word );
+	}
+}
+
+static inline void hbitmap_unset( hbitmap_t *hbitmap, unsigned i ){
+	bitmap_unset( hbitmap->map, i );
+	bitmap_unset( hbitmap->summary, i / BITMAP_BPS );
+}
+
 #endif
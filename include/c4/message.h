@@ -14,14 +14,26 @@ enum {
 	MESSAGE_TYPE_GRANT,
 	MESSAGE_TYPE_GRANT_TO,
 	MESSAGE_TYPE_REQUEST_PHYS,
+	// sent by the kernel to a thread's pager when the thread faults, with
+	// the faulting thread as the sender. data[0] is the faulting address,
+	// data[1] has MESSAGE_PAGE_FAULT_* flags and data[2] is the faulting
+	// instruction. the thread is blocked until the pager replies, usually
+	// with MAP_TO or GRANT_TO, then it retries the access.
 	MESSAGE_TYPE_PAGE_FAULT,
 	MESSAGE_TYPE_DUMP_MAPS,
+	// data[0] is a buffer and data[1] its size in bytes, which is filled
+	// with a mem_stats_t, see c4/mm/stats.h
+	MESSAGE_TYPE_MEM_STATS,
 
 	// thread control messages
 	MESSAGE_TYPE_STOP,
 	MESSAGE_TYPE_CONTINUE,
 	MESSAGE_TYPE_END,
 	MESSAGE_TYPE_KILL,
+	MESSAGE_TYPE_SET_PRIORITY,
+	MESSAGE_TYPE_SET_SCHED_CONTEXT,
+	// makes thread data[0] the target's pager
+	MESSAGE_TYPE_SET_PAGER,
 
 	// hardware interface messages
 	MESSAGE_TYPE_INTERRUPT,
@@ -43,6 +55,13 @@ enum {
 	MESSAGE_MAX_QUEUE_ELEMENTS = 64,
 };
 
+// flags for page fault messages
+enum {
+	MESSAGE_PAGE_FAULT_WRITE   = 1,
+	// the page was mapped, but not with the needed permissions
+	MESSAGE_PAGE_FAULT_PRESENT = 2,
+};
+
 typedef struct message {
 	unsigned type;
 	unsigned sender;
@@ -71,4 +90,27 @@ void message_send( message_t *msg, unsigned id );
 bool message_send_async( message_t *msg, unsigned to );
 bool message_recieve_async( message_t *msg, unsigned flags );
 
+// sends a page fault message for the current thread to its pager, and
+// blocks the thread until the pager replies. returns false if the thread
+// doesn't have a pager, otherwise it doesn't return, the thread goes back
+// to retry the access once it's woken up.
+bool message_send_page_fault( uintptr_t address, unsigned flags, uintptr_t ip );
+// called by syscalls before touching a user buffer, at linear address
+// 'address'. if any page of it isn't mapped, a fault for it is sent to the
+// current thread's pager and the syscall is restarted once the pager
+// replies, so this doesn't return. it returns if the buffer is mapped, or
+// if there's no pager to ask.
+void message_fault_in_user( uintptr_t address, unsigned long size, bool write );
+
+// bracket kernel accesses to user memory that was faulted in. a fault in
+// between means the thread's memory changed under it, and the page fault
+// handler kills the thread instead of treating it as a kernel bug. the
+// access mustn't block.
+void message_user_access_begin( void );
+void message_user_access_end( void );
+
+// drops pending messages for a thread that's being destroyed
+struct thread;
+void message_thread_cleanup( struct thread *thread );
+
 #endif
@@ -15,31 +15,43 @@ typedef struct addr_node {
 	unsigned permissions  : 3;
 } __attribute__((packed)) addr_entry_t;
 
+// where the memory behind an entry came from. owned entries hold a
+// reference to each of their frames, which is dropped when the entry is
+// removed. cloned spaces and maps of owned memory into other spaces take
+// a reference of their own, so frames are only freed along with the last
+// entry using them. mapped entries are for memory the kernel doesn't
+// manage (device memory, physical requests) and leave the frames alone.
 enum {
-	ADDR_MAP_ENTRIES_PER_PAGE = PAGE_SIZE / sizeof( addr_entry_t ) - 1,
+	ADDR_ENTRY_SOURCE_OWNED,
+	ADDR_ENTRY_SOURCE_MAPPED,
 };
 
+// entries are kept in an AVL tree ordered by virtual address. the entry
+// is the first member of its node, so entry pointers handed out by the
+// map functions stay valid until that entry is removed.
+typedef struct addr_map_node {
+	addr_entry_t entry;
+
+	struct addr_map_node *left;
+	struct addr_map_node *right;
+	struct addr_map_node *parent;
+	int height;
+} addr_map_node_t;
+
 typedef struct addr_map {
-	union {
-		// make the root info block take up one entry space
-		addr_entry_t filler;
-
-		struct {
-			region_t *region;
-			uint16_t entries;
-			uint16_t used;
-		};
-	};
-
-	// TODO: consider making a linked list of maps, so there's no arbitrary
-	//       limit on the number of mappings per task
-	addr_entry_t map[ADDR_MAP_ENTRIES_PER_PAGE];
+	addr_map_node_t *root;
+	unsigned used;
 } addr_map_t;
 
 typedef struct addr_space {
 	page_dir_t *page_dir;
 	addr_map_t *map;
 	region_t   *region;
+	// physical address of page_dir, loaded directly on address space switch
+	uintptr_t  page_dir_phys;
+	// start of the segment window for small address spaces, zero for
+	// normal spaces which have their own page directory
+	uintptr_t  small_base;
 
 	unsigned references;
 } addr_space_t;
@@ -47,10 +59,16 @@ typedef struct addr_space {
 void addr_space_init( void );
 
 addr_space_t *addr_space_clone( addr_space_t *space );
+addr_space_t *addr_space_create_small( void );
 addr_space_t *addr_space_reference( addr_space_t *space );
 addr_space_t *addr_space_kernel( void );
 void          addr_space_free( addr_space_t *space );
 void          addr_space_set( addr_space_t *space );
+addr_space_t *addr_space_active( void );
+
+uintptr_t addr_space_user_linear( addr_space_t *space,
+                                  uintptr_t address,
+                                  unsigned long size );
 
 int addr_space_map( addr_space_t *a,
                     addr_space_t *b,
@@ -60,13 +78,20 @@ int addr_space_grant( addr_space_t *a,
                       addr_space_t *b,
                       addr_entry_t *ent );
 
+// handles a write fault on a present page, copying the page if it's shared
+// copy on write with a cloned space. returns true if the fault was handled.
+bool addr_space_cow_fault( addr_space_t *space, uintptr_t address );
+
 int addr_space_unmap( addr_space_t *space, unsigned long address );
 int addr_space_insert_map( addr_space_t *space, addr_entry_t *ent );
 int addr_space_remove_map( addr_space_t *space, addr_entry_t *ent );
 
-addr_map_t *addr_map_create( region_t *region );
+void        addr_map_init( void );
+addr_map_t *addr_map_create( void );
+addr_map_t *addr_map_clone( addr_map_t *map );
 void        addr_map_free( addr_map_t *map );
 void        addr_map_dump( addr_map_t *map );
+void        addr_map_get_stats( addr_map_t *map, mem_map_stats_t *stats );
 
 addr_entry_t *addr_map_lookup( addr_map_t *map, unsigned long address );
 addr_entry_t *addr_map_split( addr_map_t *map,
@@ -76,4 +101,8 @@ addr_entry_t *addr_map_carve( addr_map_t *map, addr_entry_t *entry );
 void          addr_map_remove( addr_map_t *map, addr_entry_t *entry );
 addr_entry_t *addr_map_insert( addr_map_t *map, addr_entry_t *entry );
 
+// in-order iteration, from the lowest virtual address up
+addr_entry_t *addr_map_first( addr_map_t *map );
+addr_entry_t *addr_map_next( addr_entry_t *entry );
+
 #endif
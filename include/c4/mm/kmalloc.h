@@ -0,0 +1,20 @@
+#ifndef _C4_MM_KMALLOC_H
+#define _C4_MM_KMALLOC_H 1
+#include <stddef.h>
+
+enum {
+	// sizes are rounded up to a power of two from KMALLOC_MIN_SIZE to
+	// KMALLOC_MAX_SIZE and come from a slab for that size, anything
+	// bigger is rounded up to whole pages from the global region
+	KMALLOC_MIN_SHIFT = 4,
+	KMALLOC_MAX_SHIFT = 10,
+	KMALLOC_MIN_SIZE  = 1 << KMALLOC_MIN_SHIFT,
+	KMALLOC_MAX_SIZE  = 1 << KMALLOC_MAX_SHIFT,
+	KMALLOC_CLASSES   = KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1,
+};
+
+void *kmalloc( size_t size );
+void *kzalloc( size_t size );
+void  kfree( void *ptr );
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _C4_MM_PHYS_H
+#define _C4_MM_PHYS_H 1
+#include <stdint.h>
+#include <stdbool.h>
+#include <c4/mm/stats.h>
+
+enum {
+	// allocations are 2^order pages, up to 4MB blocks
+	PHYS_MAX_ORDER = 11,
+
+	// single page cache size, and how many pages are moved to or from
+	// the buddy allocator at a time
+	PHYS_CACHE_SIZE  = 64,
+	PHYS_CACHE_BATCH = 16,
+};
+
+// phys_init() sizes the allocator to cover memory up to 'mem_end', with
+// everything unavailable. usable ram is then added with phys_add_range().
+void phys_init( uintptr_t mem_end );
+void phys_add_range( uintptr_t start, uintptr_t end );
+
+// returns the physical address of 2^order contiguous, aligned pages,
+// or 0 if there isn't a free block that large
+uintptr_t phys_alloc( unsigned order );
+void      phys_free( uintptr_t addr, unsigned order );
+
+// single page allocation through the hot page cache, this is what page
+// tables and ordinary mappings use
+uintptr_t phys_page_alloc( void );
+void      phys_page_free( uintptr_t addr );
+
+// marks a range of physical memory as used, in anticipation of a mapping
+// there, and the opposite for when the mapping goes away. memory that isn't
+// usable ram (device memory, reserved ranges) is ignored by both.
+void phys_reserve_range( uintptr_t start, uintptr_t end );
+void phys_release_range( uintptr_t start, uintptr_t end );
+
+// pages start out with one reference, and phys_frame_ref() adds another
+// for each extra address space or page table sharing the page.
+// phys_frame_unref() drops one, and returns true when it was the last, at
+// which point the caller frees the page. phys_release_range() does this
+// for each page, so shared pages survive until the last release.
+void phys_frame_ref( uintptr_t addr );
+bool phys_frame_unref( uintptr_t addr );
+bool phys_frame_is_shared( uintptr_t addr );
+
+unsigned phys_total_pages( void );
+unsigned phys_free_pages( void );
+// page table counts are filled in by the caller, see page_table_count()
+void     phys_get_stats( mem_phys_stats_t *stats );
+
+#endif
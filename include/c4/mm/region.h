@@ -1,28 +1,59 @@
 #ifndef _C4_REGION_H
 #define _C4_REGION_H 1
 #include <c4/klib/bitmap.h>
+#include <c4/mm/stats.h>
 #include <stdint.h>
 #include <stdbool.h>
 
+enum {
+	// spans up to this many pages are cached on free, still mapped,
+	// and handed out again before searching the bitmap
+	REGION_QCACHE_MAX  = 4,
+	REGION_QCACHE_SIZE = 8,
+
+	// upper limit on the size of the global region, the bitmaps for it
+	// are static since it's set up before anything else can allocate
+	REGION_GLOBAL_MAX_PAGES = 16384,
+};
+
+typedef struct region_qcache {
+	void    *spans[REGION_QCACHE_SIZE];
+	unsigned count;
+} region_qcache_t;
+
 typedef struct region {
-	bitmap_ent_t *bitmap;
+	hbitmap_t     map;
 	void         *vaddress;
 
 	unsigned num_pages;
 	unsigned available;
 	unsigned page_flags;
+
+	// qcache[i] holds free spans of i + 1 pages
+	region_qcache_t qcache[REGION_QCACHE_MAX];
 } region_t;
 
 void *region_alloc( region_t *region );
 void  region_free( region_t *region, void *page );
 
+// allocates and maps 'pages' contiguous pages, which must be freed with
+// the same size. if 'pages' is a power of two, the span is aligned to
+// its size.
+void *region_alloc_span( region_t *region, unsigned pages );
+void  region_free_span( region_t *region, void *addr, unsigned pages );
+
+// unmaps everything in the quantum caches, returning it to the region
+void  region_drain( region_t *region );
+void  region_get_stats( region_t *region, mem_region_stats_t *stats );
+
 region_t *region_init_at( region_t     *region,
                           void         *vaddress,
                           bitmap_ent_t *bitmap,
+                          bitmap_ent_t *summary,
                           unsigned     num_pages,
                           unsigned     page_flags );
 
-void region_init_global( void *addr );
+void region_init_global( void *addr, unsigned num_pages );
 region_t *region_get_global( void );
 bool region_global_is_inited( void );
 
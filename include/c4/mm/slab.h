@@ -1,50 +1,146 @@
 #ifndef _C4_SLAB_H
 #define _C4_SLAB_H 1
 #include <c4/mm/region.h>
+#include <c4/mm/stats.h>
 
 #define MAGIC          0xabadc0de
 #define MAX_FREE_SLABS 2
 #define NO_CTOR        ((void *)0)
 #define NO_DTOR        ((void *)0)
 
+enum {
+	// default object alignment, and the smallest object size, since free
+	// objects hold the freelist link
+	SLAB_MIN_ALIGN       = sizeof( void * ),
+	// objects in consecutive blocks are offset by a multiple of this, so
+	// the first objects of each block don't all compete for the same
+	// cache sets
+	SLAB_COLOUR_STEP     = 64,
+	// blocks grow in powers of two up to this many pages to fit objects
+	// with little waste
+	SLAB_MAX_BLOCK_PAGES = 8,
+	SLAB_MIN_OBJS        = 8,
+
+	// objects per magazine, sized so a magazine is 64 bytes
+	SLAB_MAGAZINE_SIZE   = 14,
+	// full magazines kept in the depot before extras are emptied back
+	// into the slab
+	SLAB_DEPOT_MAX       = 4,
+};
+
+enum {
+	// set for the slab magazines themselves come from
+	SLAB_FLAG_NO_MAGAZINES = 1 << 0,
+	// blocks are always one page, so an object's block header is at the
+	// start of its page and objects are never page aligned
+	SLAB_FLAG_SINGLE_PAGE  = 1 << 1,
+};
+
 typedef struct slab slab_t;
 typedef struct slab_list slab_list_t;
 
+// free objects form a singly linked list through their first word
+typedef struct slab_free_obj {
+	struct slab_free_obj *next;
+} slab_free_obj_t;
+
 typedef struct slab_blk {
-	uint32_t     magic;
-	bitmap_ent_t map;
-	slab_t      *slab;
+	uint32_t         magic;
+	slab_t          *slab;
+	slab_free_obj_t *freelist;
+	unsigned         in_use;
 
 	struct slab_blk *prev;
 	struct slab_blk *next;
-    slab_list_t *list;
+	slab_list_t     *list;
 } slab_blk_t;
 
+// a magazine is a stack of free objects. allocations and frees normally
+// only touch the current cpu's magazines, and the block lists are used
+// when those are empty or full.
+typedef struct slab_magazine {
+	struct slab_magazine *next;
+	unsigned              count;
+	void                 *objs[SLAB_MAGAZINE_SIZE];
+} slab_magazine_t;
+
+typedef struct slab_cpu_cache {
+	slab_magazine_t *loaded;
+	slab_magazine_t *previous;
+} slab_cpu_cache_t;
+
+typedef struct slab_depot {
+	slab_magazine_t *full;
+	slab_magazine_t *empty;
+	unsigned         full_count;
+} slab_depot_t;
+
 typedef struct slab_list {
 	slab_blk_t *first;
 	unsigned size;
 } slab_list_t;
 
 typedef struct slab {
+	const char *name;
+	// next slab in the list of every slab, see slab_first()
+	struct slab *next_slab;
+
 	slab_list_t free;
 	slab_list_t partial;
 	slab_list_t full;
 	region_t *region;
 
+	// TODO: this will need to be per-cpu once SMP is working
+	slab_cpu_cache_t cpu;
+	slab_depot_t     depot;
+	unsigned         flags;
+
 	void (*ctor)(void *ptr);
 	void (*dtor)(void *ptr);
 
 	unsigned obj_size;
+	// size asked for at init, before rounding
+	unsigned req_size;
+	// objects taken out of blocks, including ones cached in magazines
+	unsigned objs_out;
+	unsigned align;
+	unsigned objs_per_block;
+	// blocks are block_pages pages, aligned to their size
+	unsigned block_pages;
+	// offset of the first object in the next block, and the largest
+	// offset that still leaves room for objs_per_block objects
+	unsigned colour;
+	unsigned colour_max;
 	unsigned total_pages;
 } slab_t;
 
 void *slab_alloc( slab_t *slab );
 void  slab_free( slab_t *slab, void *ptr );
 
+// returns every object cached in magazines to the slab, so empty blocks
+// can be freed
+void  slab_drain( slab_t *slab );
+
 slab_t *slab_init_at( slab_t *slab,
+                      const char *name,
                       region_t *region,
                       unsigned obj_size,
                       void (*ctor)(void *ptr),
                       void (*dtor)(void *ptr) );
 
+// same as above, with objects aligned to 'align' bytes, which must be a
+// power of two, and SLAB_FLAG_* flags
+slab_t *slab_init_aligned_at( slab_t *slab,
+                              const char *name,
+                              region_t *region,
+                              unsigned obj_size,
+                              unsigned align,
+                              unsigned flags,
+                              void (*ctor)(void *ptr),
+                              void (*dtor)(void *ptr) );
+
+// iterates over every slab, with slab->next_slab
+slab_t *slab_first( void );
+void    slab_get_stats( slab_t *slab, mem_slab_stats_t *stats );
+
 #endif
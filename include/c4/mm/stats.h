@@ -0,0 +1,77 @@
+#ifndef _C4_MM_STATS_H
+#define _C4_MM_STATS_H 1
+#include <stdint.h>
+
+// memory statistics, as returned to user space by MESSAGE_TYPE_MEM_STATS.
+// every field is 32 bits so the layout is the same for the kernel and
+// user programs.
+
+enum {
+	MEM_STATS_NAME_MAX = 16,
+};
+
+typedef struct mem_phys_stats {
+	// usable ram reported by the bootloader, and how much is free,
+	// including pages waiting in the hot page cache
+	uint32_t total_pages;
+	uint32_t free_pages;
+	uint32_t cached_pages;
+	// pages taken by mappings of fixed physical ranges
+	uint32_t reserved_pages;
+	uint32_t page_table_pages;
+	// size of the largest free block, as a buddy order
+	int32_t  largest_free_order;
+} mem_phys_stats_t;
+
+typedef struct mem_region_stats {
+	uint32_t total_pages;
+	uint32_t available_pages;
+	// pages held in quantum caches, allocated but unused
+	uint32_t cached_pages;
+	uint32_t largest_free_run;
+} mem_region_stats_t;
+
+typedef struct mem_slab_stats {
+	char     name[MEM_STATS_NAME_MAX];
+	uint32_t obj_size;
+	uint32_t objs_per_block;
+	uint32_t block_pages;
+	uint32_t objs_in_use;
+	// free objects held in magazines
+	uint32_t objs_cached;
+	uint32_t free_pages;
+	uint32_t partial_pages;
+	uint32_t full_pages;
+	// bytes lost to rounding object sizes up and to block slack
+	uint32_t waste_bytes;
+} mem_slab_stats_t;
+
+typedef struct mem_map_stats {
+	uint32_t entries_used;
+	// height of the map's tree
+	uint32_t tree_height;
+} mem_map_stats_t;
+
+typedef struct mem_stats {
+	mem_phys_stats_t   phys;
+	mem_region_stats_t region;
+	// address map of the thread asking
+	mem_map_stats_t    map;
+
+	// number of slabs in the kernel, and how many of them fit in the
+	// buffer and were filled in below
+	uint32_t slab_total;
+	uint32_t slab_count;
+
+	mem_slab_stats_t   slabs[];
+} mem_stats_t;
+
+struct addr_space;
+
+// fills 'stats', which is 'size' bytes long, 'space' is the address space
+// whose map is reported
+void mem_stats_collect( mem_stats_t *stats,
+                        unsigned size,
+                        struct addr_space *space );
+
+#endif
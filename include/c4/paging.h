@@ -18,11 +18,55 @@ typedef enum {
 void *map_page( unsigned permissions, void *vaddress );
 void *map_phys_page( unsigned perm, void *vaddr, void *raddr );
 void unmap_page( void *vaddress );
+void unmap_phys_page( void *vaddress );
+// returns true if there's a page mapped at 'vaddress' in the current
+// directory, whether or not it's writable
+bool page_is_present( void *vaddress );
+
+// range versions of the above, these fill and clear page table entries a
+// table at a time and invalidate the TLB once for the whole range. aligned
+// 4MB stretches of physically contiguous memory are mapped with a single
+// large page where possible, which gets split back into normal pages if
+// part of it is unmapped or remapped later. map_phys_range() returns false
+// if it ran out of memory for page tables, with part of the range mapped.
+bool map_phys_range( unsigned perm, void *vaddr, void *raddr, unsigned pages );
+void unmap_range( void *vaddr, unsigned pages );
+void unmap_phys_range( void *vaddr, unsigned pages );
 
 page_dir_t *current_page_dir( void );
 page_dir_t *page_get_kernel_dir( void );
 page_dir_t *clone_page_dir( page_dir_t *dir );
+void        page_dir_free_user_tables( page_dir_t *dir );
 void        set_page_dir( page_dir_t *dir );
-void        page_reserve_phys_range( uintptr_t start, uintptr_t end );
+uintptr_t   page_dir_phys_addr( page_dir_t *dir );
+void        page_dir_load_phys( uintptr_t addr );
+// creates the kernel directory's page tables for a range of the shared
+// part of the address space, so directories cloned later have them from
+// the start instead of picking them up on a fault. returns false if there
+// wasn't memory for them.
+bool        page_dir_prealloc_shared( void *start, void *end );
+// the directory currently in CR3, which isn't necessarily the active
+// address space's directory while a small space is active
+uintptr_t   page_dir_loaded_phys( void );
+
+// called on a write fault to a present page. if the page is shared copy on
+// write, the current directory gets its own copy of the page, or write
+// access to it if nothing else shares it anymore. returns the physical
+// address mapped at 'vaddr' afterwards, or 0 if it wasn't a copy on write
+// fault.
+uintptr_t   page_cow_fault( void *vaddr );
+
+// limits which linear addresses user code can reach to [base, base + size),
+// this is how small address spaces are kept apart. user code sees the
+// start of the window as address 0.
+void        page_set_user_window( uintptr_t base, uintptr_t size );
+
+// flushes every TLB entry, including global kernel mappings. only needed
+// when global mappings change in bulk, single pages are invalidated
+// when unmapped
+void        page_flush_global( void );
+
+// number of page tables currently allocated, not counting boot tables
+unsigned    page_table_count( void );
 
 #endif
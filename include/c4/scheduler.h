@@ -2,11 +2,17 @@
 #define _C4_SCHEDULER_H 1
 #include <c4/thread.h>
 #include <c4/arch/scheduler.h>
+#include <stdbool.h>
 
 enum {
 	SCHED_FLAG_NONE,
 	SCHED_FLAG_HAS_RAN,
 	SCHED_FLAG_PENDING_MSG,
+	// the thread a blocked send was waiting on exited before taking it
+	SCHED_FLAG_SEND_FAILED = 4,
+	// the kernel is reading or writing the thread's memory for it, see
+	// message_user_access_begin()
+	SCHED_FLAG_USER_ACCESS = 8,
 };
 
 enum {
@@ -15,17 +21,62 @@ enum {
 	SCHED_STATE_WAITING,
 	SCHED_STATE_WAITING_ASYNC,
 	SCHED_STATE_SENDING,
+	// faulted, and waiting for a reply from its pager
+	SCHED_STATE_WAITING_PAGER,
+	// exited or killed, waiting to be freed
+	SCHED_STATE_EXITED,
 };
 
+// thread priorities, threads with a priority above SCHED_PRIORITY_NORMAL
+// are in the real-time class. the highest priority runnable real-time thread
+// always runs before any normal threads, normal threads are round-robin.
+enum {
+	SCHED_PRIORITY_NORMAL = 0,
+	SCHED_PRIORITY_MAX    = 255,
+};
+
+// scheduling contexts limit how much cpu time the threads running on them
+// get, budget ticks every period ticks. threads without a context aren't
+// limited. a thread recieving a synchronous message runs on the sender's
+// context until it waits for the next message, so time spent in servers is
+// charged to their clients.
+typedef struct sched_context {
+	unsigned budget;
+	unsigned period;
+	// ticks left in the current period
+	unsigned remaining;
+	// tick count at the start of the next period
+	unsigned long replenish;
+
+	unsigned references;
+} sched_context_t;
+
 void init_scheduler( void );
 void sched_switch_thread( void );
 void sched_do_thread_switch( thread_t *cur, thread_t *next );
 void sched_jump_to_thread( thread_t *thread );
 void sched_add_thread( thread_t *thread );
+bool sched_thread_can_yield_to( thread_t *thread );
+bool sched_thread_yield_to( thread_t *thread );
+void sched_thread_block( thread_cont_t cont );
 
 void sched_thread_continue( thread_t *thread );
 void sched_thread_stop( thread_t *thread );
 void sched_thread_exit( void );
+void sched_thread_kill( thread_t *thread );
+void sched_thread_set_priority( thread_t *thread, unsigned priority );
+void sched_thread_wakeup( thread_t *thread );
+void sched_preempt_check( void );
+void sched_timer_tick( void );
+unsigned long sched_ticks( void );
+
+sched_context_t *sched_context_create( unsigned budget, unsigned period );
+sched_context_t *sched_context_reference( sched_context_t *ctx );
+void sched_context_free( sched_context_t *ctx );
+sched_context_t *sched_thread_context( thread_t *thread );
+void sched_thread_set_context( thread_t *thread, sched_context_t *ctx );
+void sched_thread_donate( thread_t *from, thread_t *to );
+void sched_thread_release_donation( thread_t *thread );
 
 thread_t *sched_current_thread( void );
 
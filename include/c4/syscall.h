@@ -10,9 +10,18 @@ enum {
 	SYSCALL_SEND_ASYNC,
 	SYSCALL_RECIEVE_ASYNC,
 	SYSCALL_IOPORT,
+	SYSCALL_YIELD,
 	SYSCALL_MAX,
 };
 
+// special targets for SYSCALL_YIELD, anything else is a thread id
+enum {
+	// yield to whatever the scheduler picks next
+	SYSCALL_YIELD_ANY    = -1,
+	// yield to the sender of the last message this thread recieved
+	SYSCALL_YIELD_SENDER = -2,
+};
+
 // XXX: architecture-specific workaround, will need to be removed in the future
 enum {
 	SYSCALL_IO_INPUT,
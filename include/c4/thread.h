@@ -15,10 +15,14 @@ enum {
 	THREAD_CREATE_FLAG_NONE   = 0,
 	THREAD_CREATE_FLAG_CLONE  = 1,
 	THREAD_CREATE_FLAG_NEWMAP = 2,
+	// used along with NEWMAP, puts the new thread in a small address space
+	// if one is available. see SMALL_SPACE_BASE in paging.h
+	THREAD_CREATE_FLAG_SMALL  = 4,
 };
 
 typedef struct thread      thread_t;
 typedef struct thread_node thread_node_t;
+typedef void (*thread_cont_t)( thread_t *thread );
 
 typedef struct thread_list {
 	thread_node_t *first;
@@ -35,13 +39,31 @@ typedef struct thread_node {
 typedef struct thread {
 	thread_regs_t registers;
 	addr_space_t  *addr_space;
-	void          *kernel_stack;
+	// stack page for kernel threads, user threads share the per-cpu
+	// kernel stack instead
+	void          *kthread_stack;
+
+	// where a blocked user thread picks up when it's switched back to,
+	// see sched_thread_block(). ipc_buffer is where the message the thread
+	// is waiting for goes.
+	thread_cont_t continuation;
+	message_t     *ipc_buffer;
 
 	thread_node_t intern;
 	thread_node_t sched;
 	thread_list_t waiting;
 
+	// the thread's own scheduling context, and the context donated by
+	// a client it recieved a message from, see scheduler.h
+	struct sched_context *sched_ctx;
+	struct sched_context *donated_ctx;
+	// the client whose request the thread is handling, 0 if none
+	unsigned donor;
+
 	unsigned id;
+	// thread sent page fault messages, 0 if faults are fatal. thread 0 is
+	// always a kernel thread, so it's never a pager.
+	unsigned pager;
 	unsigned priority;
 	unsigned state;
 	unsigned flags;
@@ -66,6 +88,9 @@ thread_t *thread_list_pop( thread_list_t *list );
 thread_t *thread_list_peek( thread_list_t *list );
 
 thread_t *thread_get_id( unsigned id );
+// calls 'func' on every thread, which mustn't create or destroy threads
+void thread_for_each( void (*func)( thread_t *thread, void *data ),
+                      void *data );
 
 // functions below are implemented in arch-specific code
 void thread_set_init_state( thread_t *thread,
@@ -75,4 +100,21 @@ void thread_set_init_state( thread_t *thread,
 
 void usermode_jump( void *entry, void *stack );
 
+// user threads are resumed from a saved copy of their user state rather
+// than from their kernel stack, these move it to and from the kernel stack.
+// thread_set_syscall_return() sets the return value for the syscall the
+// current thread is in, for syscalls that finish in a continuation.
+void thread_save_user_state( thread_t *thread );
+void thread_load_user_state( thread_t *thread );
+void thread_set_syscall_return( thread_t *thread, uintptr_t value );
+// makes the current thread's syscall start over once the thread returns to
+// user mode, instead of returning. returns the address of the syscall
+// instruction.
+uintptr_t thread_restart_syscall( thread_t *thread );
+
+// lazy fpu state handling, called when switching to a thread and when
+// a thread is destroyed
+void thread_fpu_switch( thread_t *thread );
+void thread_fpu_release( thread_t *thread );
+
 #endif
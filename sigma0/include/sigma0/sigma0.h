@@ -26,6 +26,7 @@ int c4_msg_send( message_t *buffer, unsigned target );
 int c4_msg_recieve( message_t *buffer, unsigned whom );
 int c4_msg_send_async( message_t *buffer, unsigned target );
 int c4_msg_recieve_async( message_t *buffer, unsigned flags );
+int c4_yield_to( unsigned thread );
 int c4_create_thread( void *entry, void *stack, unsigned flags );
 int c4_continue_thread( unsigned thread );
 
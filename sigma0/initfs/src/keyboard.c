@@ -38,7 +38,16 @@ int c4_msg_recieve_async( message_t *buffer, unsigned flags ){
 void _start( void *data ){
 	uintptr_t display = (uintptr_t)data;
 
+	// run in the real-time class, so keypresses are handled right away
+	// even when other threads are using all of the cpu
 	message_t msg = {
+		.type = MESSAGE_TYPE_SET_PRIORITY,
+		.data = { 10, },
+	};
+
+	c4_msg_send( &msg, 0 );
+
+	msg = (message_t){
 		.type = MESSAGE_TYPE_INTERRUPT_SUBSCRIBE,
 		.data = { INTERRUPT_KEYBOARD, },
 	};
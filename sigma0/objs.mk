@@ -14,9 +14,12 @@ sigma0/%.o: sigma0/%.c
 	@echo CC $< -c -o $@
 	@$(KERN_CC) $(SIGMA0_CFLAGS) $< -c -o $@
 
+# link initfs programs low, so small ones fit in a small address space
+USER_LDFLAGS   = -Wl,-Ttext-segment=0x1000
+
 sigma0/initfs/bin/%: sigma0/initfs/src/%.c
 	@echo CC $< -c -o $@
-	@$(KERN_CC) $(SIGMA0_CFLAGS) $< -o $@
+	@$(KERN_CC) $(SIGMA0_CFLAGS) $(USER_LDFLAGS) $< -o $@
 
 sigma0/%.o: sigma0/%.fs
 	@echo LD $< -o $@
@@ -82,34 +82,65 @@ static inline void elf_load_set_arg( uint8_t *stack,
 	*((unsigned *)(stack + offset) + arg + 1) = value;
 }
 
+// programs which fit below the top page of a small address space window
+// (including their stack) are started in one, so switching to them
+// doesn't need a TLB flush
+static bool elf_fits_small_space( Elf32_Ehdr *elf ){
+	uintptr_t image_end = 0;
+
+	for ( unsigned i = 0; i < elf->e_phnum; i++ ){
+		Elf32_Phdr *header = elf_get_phdr( elf, i );
+		uintptr_t end = header->p_vaddr + header->p_memsz;
+
+		if ( end > image_end ){
+			image_end = end;
+		}
+	}
+
+	return image_end <= SMALL_SPACE_SIZE - PAGE_SIZE;
+}
+
 int elf_load( Elf32_Ehdr *elf, int display ){
 	unsigned stack_offset = 0xff8;
+	bool     small        = elf_fits_small_space( elf );
+	unsigned flags        = THREAD_CREATE_FLAG_NEWMAP;
 
 	void *entry      = (void *)elf->e_entry;
 	void *to_stack   = (uint8_t *)0xa0000000;
 	void *from_stack = (uint8_t *)allot_pages(1);
-	void *stack      = (uint8_t *)to_stack + stack_offset;
+
+	if ( small ){
+		to_stack = (uint8_t *)(SMALL_SPACE_SIZE - PAGE_SIZE);
+		flags   |= THREAD_CREATE_FLAG_SMALL;
+	}
+
+	void *stack = (uint8_t *)to_stack + stack_offset;
 
 	// copy the output info to the new stack
 	elf_load_set_arg( from_stack, stack_offset, 0, display );
 
-	int thread_id = c4_create_thread( entry, stack,
-	                                  THREAD_CREATE_FLAG_NEWMAP);
+	int thread_id = c4_create_thread( entry, stack, flags );
 
 	c4_mem_grant_to( thread_id, from_stack, to_stack, 1,
 	                 PAGE_READ | PAGE_WRITE );
 
-	// load program headers
+	// load program headers. only the pages with file data are granted up
+	// front, the rest of the segment (bss) is zero-filled on first touch
+	// by handle_page_fault()
 	for ( unsigned i = 0; i < elf->e_phnum; i++ ){
 		Elf32_Phdr *header = elf_get_phdr( elf, i );
 		uint8_t *progdata  = (uint8_t *)elf + header->p_offset;
 		void    *addr      = (void *)header->p_vaddr;
-		unsigned pages     = header->p_memsz / PAGE_SIZE
-		                   + header->p_memsz % PAGE_SIZE > 0;
-		uint8_t *databuf   = allot_pages( pages );
+		unsigned pages     = (header->p_filesz + PAGE_SIZE - 1) / PAGE_SIZE;
+
+		if ( pages == 0 ){
+			continue;
+		}
+
+		uint8_t *databuf = allot_pages( pages );
 
-		for ( unsigned k = 0; k < header->p_filesz; k++ ){
-			databuf[k] = progdata[k];
+		for ( unsigned k = 0; k < pages * PAGE_SIZE; k++ ){
+			databuf[k] = (k < header->p_filesz)? progdata[k] : 0;
 		}
 
 		// TODO: translate elf permissions into message permissions
@@ -136,6 +167,30 @@ void test_thread( void *data ){
 
 extern const char *foo;
 
+// sigma0 is the pager for every thread it starts, faults are resolved by
+// granting a fresh zeroed page, so stacks, heaps and bss are only backed
+// by memory once they're touched
+static void handle_page_fault( message_t *msg ){
+	uintptr_t to = msg->data[0] & ~(PAGE_SIZE - 1);
+
+	// the first page is never mapped, so null pointers keep faulting
+	if ( to == 0 ){
+		message_t kill = { .type = MESSAGE_TYPE_KILL, };
+
+		c4_msg_send( &kill, msg->sender );
+		return;
+	}
+
+	uint8_t *page = allot_pages( 1 );
+
+	for ( unsigned i = 0; i < PAGE_SIZE; i++ ){
+		page[i] = 0;
+	}
+
+	c4_mem_grant_to( msg->sender, page, (void *)to, 1,
+	                 PAGE_READ | PAGE_WRITE );
+}
+
 void server( void *data ){
 	message_t msg;
 	struct foo *meh = data;
@@ -143,6 +198,11 @@ void server( void *data ){
 	while ( true ){
 		c4_msg_recieve( &msg, 0 );
 
+		if ( msg.type == MESSAGE_TYPE_PAGE_FAULT ){
+			handle_page_fault( &msg );
+			continue;
+		}
+
 		char c = decode_scancode( msg.data[0] );
 
 		if ( c && msg.data[1] == 0 ){
@@ -365,6 +425,14 @@ int c4_msg_recieve_async( message_t *buffer, unsigned flags ){
 	return ret;
 }
 
+int c4_yield_to( unsigned thread ){
+	int ret = 0;
+
+	DO_SYSCALL( SYSCALL_YIELD, thread, 0, 0, 0, ret );
+
+	return ret;
+}
+
 int c4_create_thread( void *entry, void *stack, unsigned flags ){
 	int ret = 0;
 
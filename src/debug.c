@@ -7,19 +7,129 @@ const char *hexadecimal = "0123456789abcdef";
 const char *decimal     = "0123456789";
 const char *binary      = "01";
 
-void debug_puts( const char *str ){
+// log messages are stored in the ring as records, each one a header
+// followed by the message text, padded so headers are always aligned.
+// writers reserve space by moving the head forward with a compare and
+// swap, fill in their record and then mark it ready, so messages from
+// interrupt handlers can't tear messages they interrupted. the output
+// code is the only reader, and stops at the first record that isn't
+// ready yet. the reader zeroes each record once it's consumed, so free
+// space always reads as not ready.
+typedef struct debug_record {
+	uint16_t length;
+	uint16_t ready;
+} debug_record_t;
+
+enum {
+	DEBUG_RING_MASK = DEBUG_RING_SIZE - 1,
+};
+
+static uint8_t  ring_data[DEBUG_RING_SIZE] __attribute__((aligned(4)));
+static uint32_t ring_head = 0;
+static uint32_t ring_tail = 0;
+// bytes of the record at ring_tail that have been read already
+static uint32_t read_offset = 0;
+// messages dropped because the ring was full
+static uint32_t ring_dropped = 0;
+
+static unsigned debug_level = DEBUG_LEVEL_INFO;
+
+static inline unsigned record_size( unsigned length ){
+	return (sizeof( debug_record_t ) + length + 3) & ~3;
+}
+
+static void debug_ring_write( const char *str, unsigned length ){
+	unsigned size = record_size( length );
+	uint32_t head;
+
+	do {
+		head = __atomic_load_n( &ring_head, __ATOMIC_RELAXED );
+		uint32_t tail = __atomic_load_n( &ring_tail, __ATOMIC_ACQUIRE );
+
+		if ( head - tail + size > DEBUG_RING_SIZE ){
+			__atomic_fetch_add( &ring_dropped, 1, __ATOMIC_RELAXED );
+			return;
+		}
+
+	} while ( !__atomic_compare_exchange_n( &ring_head, &head, head + size,
+	                                        false, __ATOMIC_ACQ_REL,
+	                                        __ATOMIC_RELAXED ));
+
+	debug_record_t *rec = (void *)(ring_data + (head & DEBUG_RING_MASK));
+
+	for ( unsigned i = 0; i < length; i++ ){
+		uint32_t pos = head + sizeof( debug_record_t ) + i;
+
+		ring_data[pos & DEBUG_RING_MASK] = str[i];
+	}
+
+	rec->length = length;
+	__atomic_store_n( &rec->ready, 1, __ATOMIC_RELEASE );
+
+	debug_output_kick( );
+}
+
+int debug_ring_getchar( void ){
+	uint32_t tail = ring_tail;
+
+	while ( tail != __atomic_load_n( &ring_head, __ATOMIC_ACQUIRE )){
+		debug_record_t *rec = (void *)(ring_data + (tail & DEBUG_RING_MASK));
+
+		if ( !__atomic_load_n( &rec->ready, __ATOMIC_ACQUIRE )){
+			break;
+		}
+
+		if ( read_offset < rec->length ){
+			uint32_t pos = tail + sizeof( debug_record_t ) + read_offset++;
+
+			return ring_data[pos & DEBUG_RING_MASK];
+		}
+
+		// finished with this record, give the space back to writers.
+		// later headers can land anywhere in it, so all of it is cleared,
+		// otherwise old text could look like a ready header to the
+		// reader while a writer is still filling that record in
+		uint32_t end = tail + record_size( rec->length );
+
+		while ( tail != end ){
+			ring_data[tail++ & DEBUG_RING_MASK] = 0;
+		}
+
+		read_offset = 0;
+		__atomic_store_n( &ring_tail, tail, __ATOMIC_RELEASE );
+	}
+
+	return -1;
+}
+
+// messages are formatted into one of these on the stack, then copied
+// into the ring as a single record
+typedef struct debug_buf {
+	char     data[DEBUG_LINE_MAX];
+	unsigned length;
+} debug_buf_t;
+
+static inline void buf_putchar( debug_buf_t *buf, char c ){
+	if ( buf->length < DEBUG_LINE_MAX ){
+		buf->data[buf->length++] = c;
+	}
+}
+
+static void buf_puts( debug_buf_t *buf, const char *str ){
 	for ( unsigned i = 0; str[i]; i++ ){
-		debug_putchar( str[i] );
+		buf_putchar( buf, str[i] );
 	}
 }
 
-void debug_print_num( unsigned long n, const char *base_str ){
+static void buf_print_num( debug_buf_t *buf, unsigned long n,
+                           const char *base_str )
+{
 	char stack[33];
 	unsigned base = strlen(base_str);
 	unsigned i;
 
 	if ( n == 0 || base == 0 ){
-		debug_putchar( '0' );
+		buf_putchar( buf, '0' );
 		return;
 	}
 
@@ -29,36 +139,41 @@ void debug_print_num( unsigned long n, const char *base_str ){
 	}
 
 	while ( i ){
-		debug_putchar( stack[--i] );
+		buf_putchar( buf, stack[--i] );
 	}
 }
 
-void debug_printf( const char *format, ... ){
-	va_list args;
-	va_start( args, format );
+static void debug_vlog( unsigned level, const char *format, va_list args ){
+	debug_buf_t buf;
+
+	if ( level < debug_level ){
+		return;
+	}
+
+	buf.length = 0;
 
 	for ( unsigned i = 0; format[i]; i++ ){
 		if ( format[i] == '%' ){
 			switch( format[++i] ){
 				case 's':
-					debug_puts( va_arg( args, char* ));
+					buf_puts( &buf, va_arg( args, char* ));
 					break;
 
 				case 'u':
-					debug_print_num( va_arg( args, unsigned ), decimal );
+					buf_print_num( &buf, va_arg( args, unsigned ), decimal );
 					break;
 
 				case 'x':
-					debug_print_num( va_arg( args, unsigned ), hexadecimal );
+					buf_print_num( &buf, va_arg( args, unsigned ), hexadecimal );
 					break;
 
 				case 'b':
-					debug_print_num( va_arg( args, unsigned ), binary );
+					buf_print_num( &buf, va_arg( args, unsigned ), binary );
 					break;
 
 				case 'p':
-					debug_puts( "0x" );
-					debug_print_num( va_arg( args, uintptr_t ), hexadecimal );
+					buf_puts( &buf, "0x" );
+					buf_print_num( &buf, va_arg( args, uintptr_t ), hexadecimal );
 					break;
 
 				default:
@@ -66,9 +181,43 @@ void debug_printf( const char *format, ... ){
 			}
 
 		} else {
-			debug_putchar( format[i] );
+			buf_putchar( &buf, format[i] );
 		}
 	}
-	
+
+	debug_ring_write( buf.data, buf.length );
+}
+
+void debug_putchar( int c ){
+	char temp = c;
+
+	debug_ring_write( &temp, 1 );
+}
+
+void debug_puts( const char *str ){
+	unsigned length = strlen( str );
+
+	debug_ring_write( str, (length < DEBUG_LINE_MAX)? length : DEBUG_LINE_MAX );
+}
+
+void debug_printf( const char *format, ... ){
+	va_list args;
+	va_start( args, format );
+
+	debug_vlog( DEBUG_LEVEL_INFO, format, args );
+
 	va_end( args );
 }
+
+void debug_log( unsigned level, const char *format, ... ){
+	va_list args;
+	va_start( args, format );
+
+	debug_vlog( level, format, args );
+
+	va_end( args );
+}
+
+void debug_set_level( unsigned level ){
+	debug_level = level;
+}
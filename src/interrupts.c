@@ -12,6 +12,12 @@ void interrupt_callback( unsigned num, unsigned flags ){
 
 	thread_t *thread = thread_get_id( listening_threads[num] );
 
+	// the listening thread exited
+	if ( !thread ){
+		listening_threads[num] = 0;
+		return;
+	}
+
 	message_t msg = {
 		.type = MESSAGE_TYPE_INTERRUPT,
 		.data = {
@@ -19,8 +25,8 @@ void interrupt_callback( unsigned num, unsigned flags ){
 		}
 	};
 
-	debug_printf( "got here, sending interrupt %u to %u\n",
-				  num, thread->id );
+	debug_log( DEBUG_LEVEL_TRACE, "sending interrupt %u to %u\n",
+	           num, thread->id );
 
 	// TODO: maybe change message_send_async() to take a thread_t argument
 	//       rather than a thread id, so it doesn't have to unnecessarily
@@ -34,8 +40,8 @@ int interrupt_listen( unsigned num, thread_t *thread ){
 		return -1;
 	}
 
-	debug_printf( "got here, thread %u listening for interrupt %u\n",
-				  thread->id, num );
+	debug_printf( "thread %u listening for interrupt %u\n",
+	              thread->id, num );
 
 	// TODO: store a list of threads to send a message to
 	listening_threads[num] = thread->id;
@@ -0,0 +1,276 @@
+#include <c4/klib/bitmap.h>
+
+// mask of 'count' bits starting at 'offset', within one section
+static inline bitmap_ent_t range_mask( unsigned offset, unsigned count ){
+	bitmap_ent_t ones = (count >= BITMAP_BPS)
+		? BITMAP_ENT_FULL
+		: ((bitmap_ent_t)1 << count) - 1;
+
+	return ones << offset;
+}
+
+void bitmap_set_range( bitmap_ent_t *bitmap, unsigned start, unsigned count ){
+	while ( count > 0 ){
+		unsigned offset = start % BITMAP_BPS;
+		unsigned n      = BITMAP_BPS - offset;
+
+		if ( n > count ){
+			n = count;
+		}
+
+		bitmap[start / BITMAP_BPS] |= range_mask( offset, n );
+		start += n;
+		count -= n;
+	}
+}
+
+void bitmap_unset_range( bitmap_ent_t *bitmap, unsigned start, unsigned count ){
+	while ( count > 0 ){
+		unsigned offset = start % BITMAP_BPS;
+		unsigned n      = BITMAP_BPS - offset;
+
+		if ( n > count ){
+			n = count;
+		}
+
+		bitmap[start / BITMAP_BPS] &= ~range_mask( offset, n );
+		start += n;
+		count -= n;
+	}
+}
+
+int bitmap_first_free_run( bitmap_ent_t *bitmap, unsigned limit, unsigned count ){
+	unsigned run_start = 0;
+	unsigned run = 0;
+
+	if ( count == 0 ){
+		return -1;
+	}
+
+	// each step consumes a stretch of same-valued bits within one section,
+	// found with ctz rather than testing bits one at a time
+	for ( unsigned i = 0; i < limit; ){
+		unsigned offset = i % BITMAP_BPS;
+		unsigned left   = BITMAP_BPS - offset;
+		bitmap_ent_t ent = bitmap[i / BITMAP_BPS] >> offset;
+		unsigned n;
+
+		if ( ent & 1 ){
+			bitmap_ent_t inv = ~ent;
+
+			n   = inv? bitmap_ctz( inv ) : BITMAP_BPS;
+			run = 0;
+
+		} else {
+			n = ent? bitmap_ctz( ent ) : BITMAP_BPS;
+
+			if ( run == 0 ){
+				run_start = i;
+			}
+
+			run += (n < left)? n : left;
+
+			if ( run >= count ){
+				return (run_start + count <= limit)? (int)run_start : -1;
+			}
+		}
+
+		i += (n < left)? n : left;
+	}
+
+	return -1;
+}
+
+unsigned bitmap_largest_free_run( bitmap_ent_t *bitmap, unsigned limit ){
+	unsigned ret = 0;
+	unsigned run = 0;
+
+	for ( unsigned i = 0; i < limit; ){
+		unsigned offset  = i % BITMAP_BPS;
+		unsigned left    = BITMAP_BPS - offset;
+		bitmap_ent_t ent = bitmap[i / BITMAP_BPS] >> offset;
+		unsigned n;
+
+		if ( ent & 1 ){
+			n   = (~ent)? bitmap_ctz( ~ent ) : BITMAP_BPS;
+			run = 0;
+
+		} else {
+			n    = ent? bitmap_ctz( ent ) : BITMAP_BPS;
+			n    = (n < left)? n : left;
+			n    = (n < limit - i)? n : limit - i;
+			run += n;
+			ret  = (run > ret)? run : ret;
+		}
+
+		i += (n < left)? n : left;
+	}
+
+	return ret;
+}
+
+int bitmap_first_set( bitmap_ent_t *bitmap, unsigned start, unsigned end ){
+	while ( start < end ){
+		unsigned offset  = start % BITMAP_BPS;
+		bitmap_ent_t ent = bitmap[start / BITMAP_BPS] >> offset;
+
+		if ( ent ){
+			unsigned ret = start + bitmap_ctz( ent );
+
+			return (ret < end)? (int)ret : -1;
+		}
+
+		start += BITMAP_BPS - offset;
+	}
+
+	return -1;
+}
+
+int bitmap_first_free_run_aligned( bitmap_ent_t *bitmap,
+                                   unsigned limit,
+                                   unsigned count,
+                                   unsigned align )
+{
+	if ( count == 0 || align == 0 ){
+		return -1;
+	}
+
+	// try each aligned start, jumping past whatever bit was in the way
+	for ( unsigned i = 0; i + count <= limit; ){
+		int used = bitmap_first_set( bitmap, i, i + count );
+
+		if ( used < 0 ){
+			return i;
+		}
+
+		i = (used + align) / align * align;
+	}
+
+	return -1;
+}
+
+// sets the summary bits for sections in [start, start + count) bits
+static void hbitmap_update_summary( hbitmap_t *hbitmap,
+                                    unsigned start,
+                                    unsigned count )
+{
+	unsigned first = start / BITMAP_BPS;
+	unsigned last  = (start + count - 1) / BITMAP_BPS;
+
+	for ( unsigned word = first; word <= last; word++ ){
+		if ( hbitmap->map[word] == BITMAP_ENT_FULL ){
+			bitmap_set( hbitmap->summary, word );
+
+		} else {
+			bitmap_unset( hbitmap->summary, word );
+		}
+	}
+}
+
+void hbitmap_init( hbitmap_t    *hbitmap,
+                   bitmap_ent_t *map,
+                   bitmap_ent_t *summary,
+                   unsigned      bits )
+{
+	unsigned words    = BITMAP_WORDS( bits );
+	unsigned sumwords = HBITMAP_SUMMARY_WORDS( bits );
+
+	hbitmap->map     = map;
+	hbitmap->summary = summary;
+	hbitmap->bits    = bits;
+
+	for ( unsigned i = 0; i < words; i++ ){
+		map[i] = 0;
+	}
+
+	for ( unsigned i = 0; i < sumwords; i++ ){
+		summary[i] = 0;
+	}
+
+	// bits past the end of the last section are marked used, and so are
+	// summary bits past the last section, so searches never return them
+	bitmap_set_range( map, bits, words * BITMAP_BPS - bits );
+	bitmap_set_range( summary, words, sumwords * BITMAP_BPS - words );
+}
+
+int hbitmap_first_free( hbitmap_t *hbitmap ){
+	unsigned sumwords = HBITMAP_SUMMARY_WORDS( hbitmap->bits );
+
+	for ( unsigned i = 0; i < sumwords; i++ ){
+		bitmap_ent_t sum = hbitmap->summary[i];
+
+		if ( sum != BITMAP_ENT_FULL ){
+			unsigned word = i * BITMAP_BPS + bitmap_ctz( ~sum );
+
+			return word * BITMAP_BPS + bitmap_ctz( ~hbitmap->map[word] );
+		}
+	}
+
+	return -1;
+}
+
+// returns the first section at or after 'word' that isn't full, skipping
+// a summary section's worth of full ones at a time
+static unsigned hbitmap_next_nonfull( hbitmap_t *hbitmap, unsigned word ){
+	unsigned words = BITMAP_WORDS( hbitmap->bits );
+
+	while ( word < words ){
+		unsigned offset  = word % BITMAP_BPS;
+		bitmap_ent_t inv = ~hbitmap->summary[word / BITMAP_BPS] >> offset;
+
+		if ( inv ){
+			return word + bitmap_ctz( inv );
+		}
+
+		word += BITMAP_BPS - offset;
+	}
+
+	return words;
+}
+
+int hbitmap_first_free_run( hbitmap_t *hbitmap, unsigned count, unsigned align ){
+	if ( count == 1 && align <= 1 ){
+		return hbitmap_first_free( hbitmap );
+	}
+
+	if ( count == 0 ){
+		return -1;
+	}
+
+	align = align? align : 1;
+
+	// same as bitmap_first_free_run_aligned(), but a run can't start in a
+	// full section, so those are skipped through the summary first
+	for ( unsigned i = 0; i + count <= hbitmap->bits; ){
+		unsigned word = hbitmap_next_nonfull( hbitmap, i / BITMAP_BPS );
+
+		if ( word * BITMAP_BPS > i ){
+			i = (word * BITMAP_BPS + align - 1) / align * align;
+			continue;
+		}
+
+		int used = bitmap_first_set( hbitmap->map, i, i + count );
+
+		if ( used < 0 ){
+			return i;
+		}
+
+		i = (used + align) / align * align;
+	}
+
+	return -1;
+}
+
+void hbitmap_set_range( hbitmap_t *hbitmap, unsigned start, unsigned count ){
+	if ( count > 0 ){
+		bitmap_set_range( hbitmap->map, start, count );
+		hbitmap_update_summary( hbitmap, start, count );
+	}
+}
+
+void hbitmap_unset_range( hbitmap_t *hbitmap, unsigned start, unsigned count ){
+	if ( count > 0 ){
+		bitmap_unset_range( hbitmap->map, start, count );
+		hbitmap_update_summary( hbitmap, start, count );
+	}
+}
@@ -6,6 +6,8 @@
 #include <c4/klib/string.h>
 #include <c4/arch/scheduler.h>
 #include <c4/mm/slab.h>
+#include <c4/mm/phys.h>
+#include <c4/mm/stats.h>
 #include <stdbool.h>
 
 static inline bool is_kernel_msg( message_t *msg ){
@@ -15,10 +17,42 @@ static inline bool is_kernel_msg( message_t *msg ){
 static inline bool kernel_msg_handle_send( message_t *msg, thread_t *target );
 static inline bool kernel_msg_handle_recieve( message_t *msg );
 
+static void message_recieve_continue( thread_t *cur );
+
+// hands a message to a thread that's waiting for one, returns false if the
+// target isn't waiting. threads waiting on a page fault only take messages
+// from their pager.
+static bool message_deliver( message_t *msg, thread_t *target, thread_t *cur ){
+	bool waiting = target->state == SCHED_STATE_WAITING
+	            || (target->state == SCHED_STATE_WAITING_PAGER
+	                && target->pager == cur->id);
+
+	if ( waiting && (target->flags & SCHED_FLAG_PENDING_MSG) == 0 ){
+		target->message = *msg;
+		target->flags |= SCHED_FLAG_PENDING_MSG;
+		target->state = SCHED_STATE_RUNNING;
+		sched_thread_donate( cur, target );
+		sched_thread_wakeup( target );
+
+		return true;
+	}
+
+	return false;
+}
+
 void message_recieve( message_t *msg, unsigned from ){
 	thread_t *cur = sched_current_thread( );
 
-retry:
+	// done with the last message, so stop running on the sender's time
+	sched_thread_release_donation( cur );
+
+	cur->ipc_buffer = msg;
+	message_recieve_continue( cur );
+}
+
+// does the actual work for message_recieve(), this is also where the thread
+// picks up again if it had to block waiting for a message
+static void message_recieve_continue( thread_t *cur ){
 	if ( (cur->flags & SCHED_FLAG_PENDING_MSG) == 0 ){
 		thread_t *sender = thread_list_pop( &cur->waiting );
 
@@ -27,6 +61,7 @@ retry:
 		if ( sender ){
 			cur->message = sender->message;
 			sender->state = SCHED_STATE_RUNNING;
+			sched_thread_donate( sender, cur );
 
 			sched_add_thread( sender );
 
@@ -35,18 +70,27 @@ retry:
 		// until a message is recieved
 		} else {
 			cur->state = SCHED_STATE_WAITING;
-			sched_thread_yield( );
-			goto retry;
+			sched_thread_block( message_recieve_continue );
+			return;
 		}
 	}
 
+	bool mapped = true;
+
 	if ( is_kernel_msg( &cur->message )){
-		kernel_msg_handle_recieve( &cur->message );
+		mapped = kernel_msg_handle_recieve( &cur->message );
 	}
 
 	cur->state  = SCHED_STATE_RUNNING;
 	cur->flags &= ~SCHED_FLAG_PENDING_MSG;
-	*msg = cur->message;
+
+	message_user_access_begin( );
+	*cur->ipc_buffer = cur->message;
+	message_user_access_end( );
+
+	// the message is still delivered if a map in it failed, so the
+	// reciever can tell who it was from
+	thread_set_syscall_return( cur, mapped? 0 : (uintptr_t)-1 );
 }
 
 bool message_try_send( message_t *msg, unsigned id ){
@@ -71,17 +115,16 @@ bool message_try_send( message_t *msg, unsigned id ){
 	// set sender field
 	msg->sender = cur->id;
 
-	if ( thread->state == SCHED_STATE_WAITING 
-	   && (thread->flags & SCHED_FLAG_PENDING_MSG) == 0 )
-	{
-		thread->message = *msg;
-		thread->flags |= SCHED_FLAG_PENDING_MSG;
-		thread->state = SCHED_STATE_RUNNING;
+	return message_deliver( msg, thread, cur );
+}
 
-		return true;
-	}
+// the reciever has taken the message by the time the sender is woken up,
+// unless it exited first, so there's nothing left to do but return
+static void message_send_continue( thread_t *cur ){
+	bool failed = cur->flags & SCHED_FLAG_SEND_FAILED;
 
-	return false;
+	cur->flags &= ~SCHED_FLAG_SEND_FAILED;
+	thread_set_syscall_return( cur, failed? (uintptr_t)-1 : 0 );
 }
 
 void message_send( message_t *msg, unsigned id ){
@@ -101,7 +144,143 @@ void message_send( message_t *msg, unsigned id ){
 
 			thread_list_remove( &cur->sched );
 			thread_list_insert( &thread->waiting, &cur->sched );
-			sched_thread_yield( );
+			sched_thread_block( message_send_continue );
+		}
+	}
+}
+
+// takes the thread with the given id out of the list of threads blocked
+// sending to 'cur', if it's there
+static thread_t *message_waiting_sender( thread_t *cur, unsigned id ){
+	for ( thread_node_t *node = cur->waiting.first; node; node = node->next ){
+		if ( node->thread->id == id ){
+			thread_list_remove( node );
+			return node->thread;
+		}
+	}
+
+	return NULL;
+}
+
+// waits for the pager's reply to a page fault. this is also where a thread
+// that had to wait to send the fault picks up, once the pager has it.
+static void message_fault_continue( thread_t *cur ){
+	if ( cur->flags & SCHED_FLAG_SEND_FAILED ){
+		// the pager exited before taking the fault, and there's no way
+		// to continue without the page
+		cur->flags &= ~SCHED_FLAG_SEND_FAILED;
+		debug_log( DEBUG_LEVEL_ERROR, "[ipc] pager of %u exited, killing\n",
+		           cur->id );
+		sched_thread_exit( );
+	}
+
+	if ( (cur->flags & SCHED_FLAG_PENDING_MSG) == 0 ){
+		// the pager might have replied while this thread was still queued
+		// to run, in which case it's blocked sending to this thread
+		thread_t *pager = message_waiting_sender( cur, cur->pager );
+
+		if ( pager ){
+			cur->message = pager->message;
+			pager->state = SCHED_STATE_RUNNING;
+			sched_thread_donate( pager, cur );
+
+			sched_add_thread( pager );
+
+		} else {
+			cur->state = SCHED_STATE_WAITING_PAGER;
+			sched_thread_block( message_fault_continue );
+			return;
+		}
+	}
+
+	if ( is_kernel_msg( &cur->message )){
+		kernel_msg_handle_recieve( &cur->message );
+	}
+
+	// the reply isn't copied anywhere, and the thread's registers are left
+	// as they were at the fault so the access is retried
+	cur->state  = SCHED_STATE_RUNNING;
+	cur->flags &= ~SCHED_FLAG_PENDING_MSG;
+}
+
+// returns the pager that faults from the thread go to, or NULL if there
+// isn't one that can take them
+static thread_t *message_fault_pager( thread_t *thread ){
+	thread_t *pager = NULL;
+
+	if ( (thread->flags & THREAD_FLAG_USER) && thread->pager ){
+		pager = thread_get_id( thread->pager );
+	}
+
+	return (pager == thread)? NULL : pager;
+}
+
+bool message_send_page_fault( uintptr_t address, unsigned flags, uintptr_t ip ){
+	thread_t *cur   = sched_current_thread( );
+	thread_t *pager = message_fault_pager( cur );
+
+	if ( !pager ){
+		return false;
+	}
+
+	message_t msg = (message_t){
+		.type   = MESSAGE_TYPE_PAGE_FAULT,
+		.sender = cur->id,
+		.data   = {
+			// pagers see addresses the way the faulting thread does
+			address - cur->addr_space->small_base,
+			flags,
+			ip,
+		},
+	};
+
+	debug_log( DEBUG_LEVEL_TRACE, "[ipc] page fault at 0x%x, %u -> %u\n",
+	           address, cur->id, pager->id );
+
+	if ( message_deliver( &msg, pager, cur )){
+		cur->state = SCHED_STATE_WAITING_PAGER;
+
+	} else {
+		// same as message_send(), wait in the pager's queue
+		cur->message = msg;
+		cur->state   = SCHED_STATE_SENDING;
+
+		thread_list_remove( &cur->sched );
+		thread_list_insert( &pager->waiting, &cur->sched );
+	}
+
+	sched_thread_block( message_fault_continue );
+
+	// not reached, user threads don't return from blocking
+	return true;
+}
+
+void message_user_access_begin( void ){
+	sched_current_thread( )->flags |= SCHED_FLAG_USER_ACCESS;
+}
+
+void message_user_access_end( void ){
+	sched_current_thread( )->flags &= ~SCHED_FLAG_USER_ACCESS;
+}
+
+void message_fault_in_user( uintptr_t address, unsigned long size, bool write ){
+	thread_t *cur = sched_current_thread( );
+
+	if ( size == 0 || !message_fault_pager( cur )){
+		return;
+	}
+
+	uintptr_t page = address & ~(PAGE_SIZE - 1);
+	uintptr_t end  = address + size;
+
+	// copy on write pages count as mapped, the kernel's write to one is
+	// handled without the pager
+	for ( ; page < end; page += PAGE_SIZE ){
+		if ( !page_is_present( (void *)page )){
+			unsigned flags = write? MESSAGE_PAGE_FAULT_WRITE : 0;
+			uintptr_t ip   = thread_restart_syscall( cur );
+
+			message_send_page_fault( page, flags, ip );
 		}
 	}
 }
@@ -146,7 +325,7 @@ static message_node_t *message_node_alloc( message_t *msg ){
 	static bool initialized = false;
 
 	if ( !initialized ){
-		slab_init_at( &message_node_slab, region_get_global(),
+		slab_init_at( &message_node_slab, "message_node", region_get_global(),
 		              sizeof( message_node_t ), NULL, NULL );
 
 		initialized = true;
@@ -168,7 +347,7 @@ bool message_send_async( message_t *msg, unsigned to ){
 	thread_t *target  = thread_get_id( to );
 	thread_t *current = sched_current_thread( );
 
-	debug_printf( "send async: sending to %u\n", to );
+	debug_log( DEBUG_LEVEL_TRACE, "send async: sending to %u\n", to );
 
 	if ( !target ){
 		debug_printf( "[ipc] invalid message target, %u -> %u, returning\n",
@@ -187,37 +366,90 @@ bool message_send_async( message_t *msg, unsigned to ){
 
 	if ( target->state == SCHED_STATE_WAITING_ASYNC ){
 		target->state = SCHED_STATE_RUNNING;
+		sched_thread_wakeup( target );
 	}
 
-	debug_printf( "got here\n" );
 
 	return true;
 }
 
+static bool message_recieve_async_try( thread_t *cur ){
+	message_node_t *node = message_queue_remove( &cur->async_queue );
+
+	if ( node ){
+		message_user_access_begin( );
+		*cur->ipc_buffer = node->message;
+		message_user_access_end( );
+		message_node_free( node );
+		thread_set_syscall_return( cur, true );
+
+		return true;
+	}
+
+	return false;
+}
+
+static void message_recieve_async_continue( thread_t *cur ){
+	if ( !message_recieve_async_try( cur )){
+		cur->state = SCHED_STATE_WAITING_ASYNC;
+		sched_thread_block( message_recieve_async_continue );
+	}
+}
+
 bool message_recieve_async( message_t *msg, unsigned flags ){
 	thread_t *current = sched_current_thread( );
-	message_node_t *node;
 
-retry:
-	node = message_queue_remove( &current->async_queue );
+	current->ipc_buffer = msg;
 
-	if ( node ){
-		*msg = node->message;
-		message_node_free( node );
+	if ( message_recieve_async_try( current )){
 		return true;
 
 	} else if ( flags & MESSAGE_ASYNC_BLOCK ){
 		// same as message_recieve(), the sender will set the thread's state
 		// to 'running' whenever they get around to sending a message
-		debug_printf( "recieve async blocked\n", flags );
+		debug_log( DEBUG_LEVEL_TRACE, "recieve async blocked\n" );
 		current->state = SCHED_STATE_WAITING_ASYNC;
-		sched_thread_yield( );
-		goto retry;
+		sched_thread_block( message_recieve_async_continue );
+
+		return true;
 	}
 
 	return false;
 }
 
+static void message_kill_paged( thread_t *thread, void *data ){
+	thread_t *pager = data;
+
+	if ( thread->state == SCHED_STATE_WAITING_PAGER
+	  && thread->pager == pager->id )
+	{
+		debug_log( DEBUG_LEVEL_ERROR, "[ipc] pager of %u exited, killing\n",
+		           thread->id );
+		sched_thread_kill( thread );
+	}
+}
+
+void message_thread_cleanup( thread_t *thread ){
+	message_node_t *node;
+	thread_t *sender;
+
+	while (( node = message_queue_remove( &thread->async_queue ))){
+		message_node_free( node );
+	}
+
+	// threads blocked sending to this one would never be woken up, so
+	// let them continue with an error return
+	while (( sender = thread_list_pop( &thread->waiting ))){
+		sender->flags |= SCHED_FLAG_SEND_FAILED;
+		sender->state  = SCHED_STATE_RUNNING;
+		sched_add_thread( sender );
+	}
+
+	// same for threads waiting on a reply to a fault the thread already
+	// took, except they can't continue at all
+	thread_for_each( message_kill_paged, thread );
+}
+
 enum {
 	MAP_IS_MAP   = false,
 	MAP_IS_GRANT = true,
@@ -242,45 +474,70 @@ static inline bool message_map_to( message_t *msg,
 	//       the thread(s) themselves can't release memory back, because they
 	//       might have faulted and be unable to continue.
 	//
-	//       consider ways to handle granting entries away which are currently
-	//       mapped in other address spaces, but are in the current address
-	//       space as a grant.
-	//       this doesn't violate the assumptions above,
-	//       but would lead to use-after-frees if the pager is given meory
-	//       while another address space continues to use it.
-	//       one solution: keep track of the address space which gave the
-	//       current address space the entry, and keep reference counts on
-	//       entries based off of physical memory addresses.
-
-	unsigned long from   = msg->data[0];
-	unsigned long to     = msg->data[1];
+	//       maps take a reference to the frames, so granting away an
+	//       entry that's still mapped elsewhere is safe, but the pager
+	//       can't reuse the memory until every map of it is gone.
+
+	thread_t *cur = sched_current_thread( );
+
 	unsigned long size   = msg->data[2];
 	unsigned long perms  = msg->data[3];
 	bool should_send = false;
 
+	// addresses are given in each thread's own view of its address space,
+	// which for small address spaces is offset from the kernel's view
+	unsigned long from = addr_space_user_linear( cur->addr_space,
+	                                             msg->data[0],
+	                                             size * PAGE_SIZE );
+	unsigned long to   = addr_space_user_linear( target->addr_space,
+	                                             msg->data[1],
+	                                             size * PAGE_SIZE );
+
+	if ( !from || !to ){
+		debug_printf( "[ipc] invalid map range, %u -> %u, returning\n",
+		              cur->id, target->id );
+		return false;
+	}
+
 	addr_entry_t ent = (addr_entry_t){
 		.virtual     = from,
 		.size        = size,
 		.permissions = perms,
 	};
 
-	thread_t *cur = sched_current_thread( );
-
 	addr_entry_t *temp = addr_map_carve( cur->addr_space->map, &ent );
 	addr_entry_t msgbuf;
 
-	//memcpy( &msgbuf, temp, sizeof( addr_entry_t ));
-	msgbuf = *temp;
-	msgbuf.virtual = to;
-
 	if ( temp ){
+		//memcpy( &msgbuf, temp, sizeof( addr_entry_t ));
+		msgbuf = *temp;
+		msgbuf.virtual = to;
+
 		if ( grant ){
+			// ownership of the frames moves along with the entry, so
+			// don't let the removal here release them
+			temp->source = ADDR_ENTRY_SOURCE_MAPPED;
 			addr_space_remove_map( cur->addr_space, temp );
+
+		} else if ( msgbuf.source == ADDR_ENTRY_SOURCE_OWNED ){
+			// the target gets its own reference to the frames, so they
+			// stay around until both spaces are done with them
+			uintptr_t p_start = msgbuf.physical
+			                  - (msgbuf.physical % PAGE_SIZE);
+
+			for ( unsigned i = 0; i < msgbuf.size; i++ ){
+				phys_frame_ref( p_start + i * PAGE_SIZE );
+			}
 		}
 
 		if ( target->state == SCHED_STATE_STOPPED ){
 			addr_space_set( target->addr_space );
-			addr_space_insert_map( target->addr_space, &msgbuf );
+
+			if ( addr_space_insert_map( target->addr_space, &msgbuf ) < 0 ){
+				debug_printf( "[ipc] couldn't map range, %u -> %u\n",
+				              cur->id, target->id );
+			}
+
 			addr_space_set( cur->addr_space );
 
 			should_send = false;
@@ -301,13 +558,46 @@ static inline void message_request_phys( message_t *msg ){
 	thread_t *current = sched_current_thread( );
 
 	addr_entry_t ent = (addr_entry_t){
-		.virtual     = msg->data[0],
+		.virtual     = addr_space_user_linear( current->addr_space,
+		                                       msg->data[0],
+		                                       msg->data[2] * PAGE_SIZE ),
 		.physical    = msg->data[1],
 		.size        = msg->data[2],
 		.permissions = msg->data[3],
+		// the frames may be device memory or belong to another space,
+		// so they aren't released along with the entry
+		.source      = ADDR_ENTRY_SOURCE_MAPPED,
 	};
 
-	addr_space_insert_map( current->addr_space, &ent );
+	if ( !ent.virtual ){
+		debug_printf( "[ipc] invalid physical request from %u\n",
+		              current->id );
+		return;
+	}
+
+	if ( addr_space_insert_map( current->addr_space, &ent ) < 0 ){
+		debug_printf( "[ipc] couldn't map physical request from %u\n",
+		              current->id );
+	}
+}
+
+static inline void message_mem_stats( message_t *msg ){
+	thread_t *current = sched_current_thread( );
+	unsigned size     = msg->data[1];
+	uintptr_t buffer  = addr_space_user_linear( current->addr_space,
+	                                            msg->data[0], size );
+
+	if ( !buffer || size < sizeof( mem_stats_t )){
+		debug_printf( "[ipc] invalid memory stats request from %u\n",
+		              current->id );
+		return;
+	}
+
+	message_fault_in_user( buffer, size, true );
+
+	message_user_access_begin( );
+	mem_stats_collect( (mem_stats_t *)buffer, size, current->addr_space );
+	message_user_access_end( );
 }
 
 static inline bool kernel_msg_handle_send( message_t *msg, thread_t *target ){
@@ -334,6 +624,10 @@ static inline bool kernel_msg_handle_send( message_t *msg, thread_t *target ){
 			addr_map_dump( target->addr_space->map );
 			break;
 
+		case MESSAGE_TYPE_MEM_STATS:
+			message_mem_stats( msg );
+			break;
+
 		// memory control messages
 		case MESSAGE_TYPE_MAP_TO:
 			should_send = message_map_to( msg, target, MAP_IS_MAP );
@@ -361,6 +655,53 @@ static inline bool kernel_msg_handle_send( message_t *msg, thread_t *target ){
 			sched_thread_stop( target );
 			break;
 
+		// END exits the sending thread, KILL exits the target
+		case MESSAGE_TYPE_END:
+			sched_thread_exit( );
+			break;
+
+		case MESSAGE_TYPE_KILL:
+			debug_printf( "killing thread %u\n", target->id );
+
+			if ( target == current ){
+				sched_thread_exit( );
+
+			} else {
+				sched_thread_kill( target );
+			}
+			break;
+
+		// sets the priority of the sending thread, see scheduler.h
+		// TODO: this should need a capability too, nothing stops a thread
+		//       from making itself real-time and hogging the cpu
+		case MESSAGE_TYPE_SET_PRIORITY:
+			sched_thread_set_priority( current, msg->data[0] );
+			break;
+
+		// gives the target a budget of data[0] ticks every data[1] ticks,
+		// a budget of zero removes the limit
+		// TODO: capability checks here too
+		case MESSAGE_TYPE_SET_SCHED_CONTEXT:
+			sched_thread_set_context( target,
+				msg->data[0]
+					? sched_context_create( msg->data[0], msg->data[1] )
+					: NULL );
+			break;
+
+		// TODO: capability checks. until then, only threads in the same
+		//       address space, or the current pager, can change it
+		case MESSAGE_TYPE_SET_PAGER:
+			if ( target->addr_space == current->addr_space
+			  || target->pager == current->id )
+			{
+				target->pager = msg->data[0];
+
+			} else {
+				debug_printf( "[ipc] thread %u can't set pager of %u\n",
+				              current->id, target->id );
+			}
+			break;
+
 		case MESSAGE_TYPE_INTERRUPT_SUBSCRIBE:
 			interrupt_listen( msg->data[0], current );
 			break;
@@ -384,7 +725,11 @@ static inline bool kernel_msg_handle_recieve( message_t *msg ){
 				thread_t *cur = sched_current_thread( );
 				addr_entry_t *ent = (addr_entry_t *)msg->data;
 
-				addr_space_insert_map( cur->addr_space, ent );
+				if ( addr_space_insert_map( cur->addr_space, ent ) < 0 ){
+					debug_printf( "[ipc] couldn't map range, %u -> %u\n",
+					              msg->sender, cur->id );
+					return false;
+				}
 			}
 			break;
 
@@ -0,0 +1,388 @@
+#include <c4/mm/addrspace.h>
+#include <c4/mm/slab.h>
+#include <c4/debug.h>
+#include <c4/common.h>
+
+static slab_t addr_map_slab;
+static slab_t addr_node_slab;
+
+void addr_map_init( void ){
+	slab_init_at( &addr_map_slab, "addr_map", region_get_global( ),
+	              sizeof( addr_map_t ), NO_CTOR, NO_DTOR );
+	slab_init_at( &addr_node_slab, "addr_map_node", region_get_global( ),
+	              sizeof( addr_map_node_t ), NO_CTOR, NO_DTOR );
+}
+
+static inline addr_map_node_t *entry_node( addr_entry_t *entry ){
+	uintptr_t addr = (uintptr_t)entry;
+
+	return (addr_map_node_t *)addr;
+}
+
+static inline unsigned long entry_end( addr_entry_t *entry ){
+	return entry->virtual + entry->size * PAGE_SIZE;
+}
+
+static inline int node_height( addr_map_node_t *node ){
+	return node? node->height : 0;
+}
+
+static inline int node_balance( addr_map_node_t *node ){
+	return node_height( node->left ) - node_height( node->right );
+}
+
+static inline void node_update_height( addr_map_node_t *node ){
+	int left  = node_height( node->left );
+	int right = node_height( node->right );
+
+	node->height = ((left > right)? left : right) + 1;
+}
+
+static inline addr_map_node_t *node_min( addr_map_node_t *node ){
+	while ( node->left ){
+		node = node->left;
+	}
+
+	return node;
+}
+
+// points whatever referenced 'old' at 'new' instead
+static inline void node_replace_child( addr_map_t *map,
+                                       addr_map_node_t *parent,
+                                       addr_map_node_t *old,
+                                       addr_map_node_t *new )
+{
+	if ( !parent ){
+		map->root = new;
+
+	} else if ( parent->left == old ){
+		parent->left = new;
+
+	} else {
+		parent->right = new;
+	}
+}
+
+static addr_map_node_t *node_rotate_left( addr_map_t *map,
+                                          addr_map_node_t *node )
+{
+	addr_map_node_t *top = node->right;
+
+	node->right = top->left;
+	if ( top->left ){
+		top->left->parent = node;
+	}
+
+	top->parent = node->parent;
+	node_replace_child( map, node->parent, node, top );
+
+	top->left    = node;
+	node->parent = top;
+
+	node_update_height( node );
+	node_update_height( top );
+
+	return top;
+}
+
+static addr_map_node_t *node_rotate_right( addr_map_t *map,
+                                           addr_map_node_t *node )
+{
+	addr_map_node_t *top = node->left;
+
+	node->left = top->right;
+	if ( top->right ){
+		top->right->parent = node;
+	}
+
+	top->parent = node->parent;
+	node_replace_child( map, node->parent, node, top );
+
+	top->right   = node;
+	node->parent = top;
+
+	node_update_height( node );
+	node_update_height( top );
+
+	return top;
+}
+
+// restores the height invariant on the path from 'node' up to the root
+static void node_rebalance( addr_map_t *map, addr_map_node_t *node ){
+	while ( node ){
+		node_update_height( node );
+
+		int balance = node_balance( node );
+
+		if ( balance > 1 ){
+			if ( node_balance( node->left ) < 0 ){
+				node_rotate_left( map, node->left );
+			}
+
+			node = node_rotate_right( map, node );
+
+		} else if ( balance < -1 ){
+			if ( node_balance( node->right ) > 0 ){
+				node_rotate_right( map, node->right );
+			}
+
+			node = node_rotate_left( map, node );
+		}
+
+		node = node->parent;
+	}
+}
+
+addr_map_t *addr_map_create( void ){
+	addr_map_t *ret = slab_alloc( &addr_map_slab );
+
+	if ( ret ){
+		ret->root = NULL;
+		ret->used = 0;
+	}
+
+	return ret;
+}
+
+static addr_map_node_t *node_copy( addr_map_node_t *node,
+                                   addr_map_node_t *parent )
+{
+	if ( !node ){
+		return NULL;
+	}
+
+	addr_map_node_t *ret = slab_alloc( &addr_node_slab );
+	KASSERT( ret != NULL );
+
+	*ret = *node;
+	ret->parent = parent;
+	ret->left   = node_copy( node->left, ret );
+	ret->right  = node_copy( node->right, ret );
+
+	return ret;
+}
+
+addr_map_t *addr_map_clone( addr_map_t *map ){
+	addr_map_t *ret = addr_map_create( );
+
+	if ( ret ){
+		// the tree is balanced, so recursion depth is logarithmic
+		ret->root = node_copy( map->root, NULL );
+		ret->used = map->used;
+	}
+
+	return ret;
+}
+
+static void node_free( addr_map_node_t *node ){
+	if ( node ){
+		node_free( node->left );
+		node_free( node->right );
+		slab_free( &addr_node_slab, node );
+	}
+}
+
+void addr_map_free( addr_map_t *map ){
+	if ( map ){
+		node_free( map->root );
+		slab_free( &addr_map_slab, map );
+	}
+}
+
+void addr_map_dump( addr_map_t *map ){
+	unsigned i = 0;
+
+	debug_printf( "address map @ %p:\n", map );
+
+	for ( addr_entry_t *ent = addr_map_first( map );
+	      ent;
+	      ent = addr_map_next( ent ), i++ )
+	{
+		unsigned long p_start = ent->physical;
+		unsigned long p_end   = p_start + ent->size * PAGE_SIZE;
+
+		debug_printf( "  entry %u : %x -> %x\n",
+		              i, ent->virtual, entry_end( ent ));
+		debug_printf( "          : %x -> %x\n", p_start, p_end );
+	}
+}
+
+void addr_map_get_stats( addr_map_t *map, mem_map_stats_t *stats ){
+	stats->entries_used = map->used;
+	stats->tree_height  = node_height( map->root );
+}
+
+addr_entry_t *addr_map_first( addr_map_t *map ){
+	return map->root? &node_min( map->root )->entry : NULL;
+}
+
+addr_entry_t *addr_map_next( addr_entry_t *entry ){
+	addr_map_node_t *node = entry_node( entry );
+
+	if ( node->right ){
+		return &node_min( node->right )->entry;
+	}
+
+	while ( node->parent && node->parent->right == node ){
+		node = node->parent;
+	}
+
+	return node->parent? &node->parent->entry : NULL;
+}
+
+addr_entry_t *addr_map_lookup( addr_map_t *map, unsigned long address ){
+	addr_map_node_t *node = map->root;
+
+	// entries don't overlap, so at most one can contain the address
+	while ( node ){
+		if ( address < node->entry.virtual ){
+			node = node->left;
+
+		} else if ( address >= entry_end( &node->entry )){
+			node = node->right;
+
+		} else {
+			return &node->entry;
+		}
+	}
+
+	return NULL;
+}
+
+addr_entry_t *addr_map_split( addr_map_t *map,
+                              addr_entry_t *entry,
+                              unsigned long offset )
+{
+	if ( !entry ){
+		return NULL;
+	}
+
+	addr_entry_t temp = *entry;
+
+	temp.virtual  += offset * PAGE_SIZE;
+	temp.physical += offset * PAGE_SIZE;
+	temp.size     -= offset;
+
+	addr_entry_t *ret = addr_map_insert( map, &temp );
+
+	// only shrink the original once the new half is in the map
+	if ( ret ){
+		entry->size = offset;
+	}
+
+	return ret;
+}
+
+// "carve" out an entry from the middle of another existing entry
+addr_entry_t *addr_map_carve( addr_map_t *map, addr_entry_t *entry ){
+	addr_entry_t *temp = addr_map_lookup( map, entry->virtual );
+	addr_entry_t *ret  = NULL;
+
+	if ( !temp ){
+		return NULL;
+	}
+
+	uintptr_t off = (uintptr_t)entry->virtual - (uintptr_t)temp->virtual;
+	off = off / PAGE_SIZE;
+
+	// check to see if the requested region can actually be sliced out,
+	// if it's larger then return NULL to signal an error
+	if ( entry->size > temp->size - off ){
+		return NULL;
+	}
+
+	if ( off != 0 ){
+		temp = addr_map_split( map, temp, off );
+	}
+
+	ret = temp;
+
+	if ( temp && entry->size < temp->size ){
+		addr_map_split( map, temp, entry->size );
+	}
+
+	return ret;
+}
+
+void addr_map_remove( addr_map_t *map, addr_entry_t *entry ){
+	addr_map_node_t *node = entry_node( entry );
+	addr_map_node_t *rebalance_from;
+
+	debug_log( DEBUG_LEVEL_TRACE, "removing entry at 0x%x\n", entry->virtual );
+
+	if ( !node->left || !node->right ){
+		addr_map_node_t *child = node->left? node->left : node->right;
+
+		if ( child ){
+			child->parent = node->parent;
+		}
+
+		node_replace_child( map, node->parent, node, child );
+		rebalance_from = node->parent;
+
+	} else {
+		// the successor node takes this node's place in the tree, rather
+		// than moving the successor's entry, so entry pointers stay valid
+		addr_map_node_t *next = node_min( node->right );
+
+		if ( next->parent != node ){
+			rebalance_from = next->parent;
+
+			next->parent->left = next->right;
+			if ( next->right ){
+				next->right->parent = next->parent;
+			}
+
+			next->right = node->right;
+			node->right->parent = next;
+
+		} else {
+			rebalance_from = next;
+		}
+
+		next->left = node->left;
+		node->left->parent = next;
+
+		next->parent = node->parent;
+		node_replace_child( map, node->parent, node, next );
+	}
+
+	node_rebalance( map, rebalance_from );
+	slab_free( &addr_node_slab, node );
+	map->used--;
+}
+
+addr_entry_t *addr_map_insert( addr_map_t *map, addr_entry_t *entry ){
+	if ( !entry ){
+		return NULL;
+	}
+
+	addr_map_node_t *node = slab_alloc( &addr_node_slab );
+
+	if ( !node ){
+		return NULL;
+	}
+
+	addr_map_node_t *parent = NULL;
+	addr_map_node_t **link  = &map->root;
+
+	while ( *link ){
+		parent = *link;
+		link   = (entry->virtual < parent->entry.virtual)
+			? &parent->left
+			: &parent->right;
+	}
+
+	node->entry  = *entry;
+	node->left   = NULL;
+	node->right  = NULL;
+	node->parent = parent;
+	node->height = 1;
+
+	*link = node;
+	map->used++;
+
+	node_rebalance( map, parent );
+
+	return &node->entry;
+}
@@ -1,6 +1,7 @@
 #include <c4/mm/addrspace.h>
 #include <c4/mm/region.h>
 #include <c4/mm/slab.h>
+#include <c4/mm/phys.h>
 #include <c4/klib/string.h>
 #include <c4/debug.h>
 #include <c4/common.h>
@@ -8,288 +9,383 @@
 
 static slab_t addr_space_slab;
 static addr_space_t *kernel_space;
+// address space currently loaded, which kernel threads borrow instead of
+// switching to the kernel space
+static addr_space_t *active_space;
+
+// slots for small address spaces, see SMALL_SPACE_BASE in paging.h
+static bitmap_ent_t small_space_slots[SMALL_SPACE_SLOTS / BITMAP_BPS + 1];
 
 void addr_space_init( void ){
 	static bool initialized = false;
 
 	if ( !initialized ){
-		slab_init_at( &addr_space_slab, region_get_global( ),
+		slab_init_at( &addr_space_slab, "addr_space", region_get_global( ),
 		              sizeof( addr_space_t ), NO_CTOR, NO_DTOR );
+		addr_map_init( );
 
 		// manually initialize the kernel address space
 		kernel_space             = slab_alloc( &addr_space_slab );
 		kernel_space->page_dir   = page_get_kernel_dir( );
-		kernel_space->map        = addr_map_create( region_get_global( ));
+		kernel_space->map        = addr_map_create( );
 		kernel_space->region     = region_get_global( );
 		kernel_space->references = 1;
+		kernel_space->small_base = 0;
+		kernel_space->page_dir_phys =
+			page_dir_phys_addr( kernel_space->page_dir );
 
-		initialized = true;
+		active_space = kernel_space;
+		initialized  = true;
 	}
 }
 
-addr_space_t *addr_space_clone( addr_space_t *space ){
-	addr_space_t *ret = NULL;
+// takes another reference to the frames of an owned entry
+static inline void addr_entry_share( addr_entry_t *ent ){
+	uintptr_t p_start = ent->physical - (ent->physical % PAGE_SIZE);
 
-	ret = slab_alloc( &addr_space_slab );
-	KASSERT( ret != NULL );
+	if ( ent->source == ADDR_ENTRY_SOURCE_OWNED ){
+		for ( unsigned i = 0; i < ent->size; i++ ){
+			phys_frame_ref( p_start + i * PAGE_SIZE );
+		}
+	}
+}
 
-	ret->page_dir   = clone_page_dir( space->page_dir );
-	ret->map        = addr_map_create( space->region );
-	ret->region     = space->region;
-	ret->references = 1;
+// copies an entry of a small space into the current space, moved down by
+// 'base' to where the small space's threads saw it. owned memory is
+// copied a page at a time, since the window's page table is shared by
+// every directory and can't be made copy on write.
+static bool addr_space_copy_small_entry( addr_space_t *space,
+                                         addr_entry_t *ent,
+                                         uintptr_t base )
+{
+	uintptr_t v_start = ent->virtual & ~(PAGE_SIZE - 1);
+	addr_entry_t copy = *ent;
 
-	KASSERT( ret->page_dir != NULL );
-	KASSERT( ret->map      != NULL );
+	copy.virtual -= base;
 
-	memcpy( ret->map, space->map, sizeof( *ret->map ));
+	// memory the kernel doesn't manage is shared rather than copied
+	if ( ent->source == ADDR_ENTRY_SOURCE_MAPPED ){
+		return addr_space_insert_map( space, &copy ) == 0;
+	}
 
-	return ret;
-}
+	for ( unsigned i = 0; i < ent->size; i++ ){
+		uintptr_t from  = v_start + i * PAGE_SIZE;
+		uintptr_t frame = phys_page_alloc( );
 
-addr_space_t *addr_space_reference( addr_space_t *space ){
-	if ( space ){
-		space->references++;
-	}
+		if ( !frame ){
+			return false;
+		}
 
-	return space;
-}
+		// mapped writable at first so the kernel can fill it in
+		copy = (addr_entry_t){
+			.virtual     = from - base,
+			.physical    = frame,
+			.size        = 1,
+			.permissions = ent->permissions | PAGE_WRITE,
+			.source      = ADDR_ENTRY_SOURCE_OWNED,
+		};
+
+		if ( addr_space_insert_map( space, &copy ) < 0 ){
+			return false;
+		}
 
-addr_space_t *addr_space_kernel( void ){
-	return kernel_space;
-}
+		memcpy( (void *)copy.virtual, (void *)from, PAGE_SIZE );
 
-void addr_space_free( addr_space_t *space ){
-	if ( space && --space->references == 0 ){
-		region_free( space->region, space->page_dir );
-		addr_map_free( space->map );
-		slab_free( &addr_space_slab, space );
+		if ( !(ent->permissions & PAGE_WRITE) ){
+			addr_map_lookup( space->map, copy.virtual )->permissions =
+				ent->permissions;
+			map_phys_range( ent->permissions, (void *)copy.virtual,
+			                (void *)frame, 1 );
+		}
 	}
-}
 
-void addr_space_set( addr_space_t *space ){
-	set_page_dir( space->page_dir );
+	return true;
 }
 
-int addr_space_map( addr_space_t *a,
-                    addr_space_t *b,
-                    addr_entry_t *ent );
+// small spaces are cloned into a normal space, with a copy of each entry
+// at the address the source's threads used for it
+static bool addr_space_clone_small( addr_space_t *ret, addr_space_t *space ){
+	addr_space_t *prev = active_space;
+	bool ok = true;
 
-int addr_space_grant( addr_space_t *a,
-                      addr_space_t *b,
-                      addr_entry_t *ent );
+	addr_space_set( ret );
 
-int addr_space_unmap( addr_space_t *space, unsigned long address ){
-	return 0;
-}
+	for ( addr_entry_t *ent = addr_map_first( space->map );
+	      ent && ok;
+	      ent = addr_map_next( ent ))
+	{
+		ok = addr_space_copy_small_entry( ret, ent, space->small_base );
+	}
 
-int addr_space_insert_map( addr_space_t *space, addr_entry_t *ent ){
-	uintptr_t v_start = ent->virtual  - (ent->virtual  % PAGE_SIZE);
-	uintptr_t p_start = ent->physical - (ent->physical % PAGE_SIZE);
+	addr_space_set( prev );
 
-	addr_map_insert( space->map, ent );
-	page_reserve_phys_range( p_start, p_start + ent->size * PAGE_SIZE );
+	return ok;
+}
 
-	for ( uintptr_t page = 0; page < ent->size * PAGE_SIZE; page += PAGE_SIZE )
-	{
-		void *v = (void *)(v_start + page);
-		void *p = (void *)(p_start + page);
+// returns NULL if there wasn't memory to copy a small space
+addr_space_t *addr_space_clone( addr_space_t *space ){
+	addr_space_t *ret = NULL;
 
-		map_phys_page( ent->permissions, v, p );
-	}
+	ret = slab_alloc( &addr_space_slab );
+	KASSERT( ret != NULL );
 
-	return 0;
-}
+	ret->page_dir   = clone_page_dir( space->page_dir );
+	ret->map        = space->small_base? addr_map_create( )
+	                                   : addr_map_clone( space->map );
+	ret->region     = space->region;
+	ret->small_base = 0;
+	ret->references = 1;
 
-int addr_space_remove_map( addr_space_t *space, addr_entry_t *ent ){
-	uintptr_t v_start = ent->virtual  - (ent->virtual  % PAGE_SIZE);
+	KASSERT( ret->page_dir != NULL );
+	KASSERT( ret->map      != NULL );
 
-	// TODO: keep track of whether physical pages are still reserved
-	//       by other processes or not
-	//       alternatively, just give the kernel a fixed-size pool of memory
-	//       so it doesn't need to keep track
-	//page_reserve_phys_range( p_start, p_start + ent->size * PAGE_SIZE );
-	debug_printf( "removing mapping 0x%x of size %u\n", v_start, ent->size );
+	ret->page_dir_phys = page_dir_phys_addr( ret->page_dir );
 
-	for ( uintptr_t page = 0; page < ent->size * PAGE_SIZE; page += PAGE_SIZE )
-	{
-		void *v = (void *)(v_start + page);
+	if ( space->small_base ){
+		if ( !addr_space_clone_small( ret, space )){
+			debug_printf( "warning: couldn't copy small space for clone\n" );
+			addr_space_free( ret );
+			return NULL;
+		}
 
-		//map_phys_page( ent->permissions, v, p );
-		unmap_page( v );
+		return ret;
 	}
 
-	addr_map_remove( space->map, ent );
+	// page tables are shared copy on write by the directories now, and
+	// frames are shared by both spaces until one of them writes
+	for ( addr_entry_t *ent = addr_map_first( ret->map );
+	      ent;
+	      ent = addr_map_next( ent ))
+	{
+		addr_entry_share( ent );
+	}
 
-	return 0;
+	return ret;
 }
 
-addr_map_t *addr_map_create( region_t *region ){
-	addr_map_t *ret = region_alloc( region );
+// small address spaces don't get their own page directory, they're given
+// a window in the shared part of every directory instead. switching to one
+// only needs the user segments changed, not CR3.
+addr_space_t *addr_space_create_small( void ){
+	int slot = bitmap_first_free( small_space_slots, SMALL_SPACE_SLOTS );
+	addr_space_t *ret = NULL;
 
-	if ( ret ){
-		memset( ret, 0, sizeof( *ret ));
+	if ( slot < 0 ){
+		return NULL;
+	}
 
-		ret->region     = region;
-		ret->entries    = ADDR_MAP_ENTRIES_PER_PAGE;
-		ret->used       = 0;
+	ret = slab_alloc( &addr_space_slab );
+	KASSERT( ret != NULL );
 
-		debug_printf( "map size (w/ root):  %u\n", sizeof( addr_map_t ));
-		debug_printf( "map size (w/o root): %u\n", sizeof( ret->map ));
-		debug_printf( "entries per page:    %u\n", ADDR_MAP_ENTRIES_PER_PAGE );
-	}
+	ret->page_dir      = kernel_space->page_dir;
+	ret->page_dir_phys = kernel_space->page_dir_phys;
+	ret->map           = addr_map_create( );
+	ret->region        = kernel_space->region;
+	ret->small_base    = SMALL_SPACE_BASE + slot * SMALL_SPACE_SIZE;
+	ret->references    = 1;
+
+	KASSERT( ret->map != NULL );
+
+	bitmap_set( small_space_slots, slot );
 
 	return ret;
 }
 
-void addr_map_free( addr_map_t *map ){
-	if ( map ){
-		region_free( map->region, map );
+addr_space_t *addr_space_reference( addr_space_t *space ){
+	if ( space ){
+		space->references++;
 	}
-}
 
-void addr_map_dump( addr_map_t *map ){
-	debug_printf( "address map @ %p:\n", map );
+	return space;
+}
 
-	for ( unsigned i = 0; i < map->used; i++ ){
-		unsigned long start = map->map[i].virtual;
-		unsigned long end   = start + map->map[i].size * PAGE_SIZE;
+addr_space_t *addr_space_kernel( void ){
+	return kernel_space;
+}
 
-		unsigned long p_start = map->map[i].physical;
-		unsigned long p_end   = p_start + map->map[i].size * PAGE_SIZE;
+static inline void addr_entry_release( addr_entry_t *ent ){
+	uintptr_t p_start = ent->physical - (ent->physical % PAGE_SIZE);
 
-		debug_printf( "  entry %u : %x -> %x\n", i, start, end );
-		debug_printf( "          : %x -> %x\n", p_start, p_end );
+	if ( ent->source == ADDR_ENTRY_SOURCE_OWNED ){
+		phys_release_range( p_start, p_start + ent->size * PAGE_SIZE );
 	}
 }
 
-static inline addr_map_t *addr_map_get_root( addr_entry_t *entry ){
-	if ( entry ){
-		uintptr_t temp = (uintptr_t)entry;
+static void addr_space_free_small( addr_space_t *space ){
+	unsigned slot = (space->small_base - SMALL_SPACE_BASE) / SMALL_SPACE_SIZE;
 
-		return (void *)(temp - (temp % PAGE_SIZE));
+	// the window's page table stays around for the next space to use the
+	// slot, so make sure nothing is left mapped in it
+	while ( space->map->used ){
+		addr_space_remove_map( space, addr_map_first( space->map ));
 	}
 
-	return NULL;
+	bitmap_unset( small_space_slots, slot );
 }
 
-static inline void addr_map_shift_upwards( addr_map_t *map, unsigned index ){
-	for ( unsigned i = map->used; i > index; i-- ){
-		map->map[i] = map->map[i - 1];
-	}
+void addr_space_free( addr_space_t *space ){
+	if ( space && --space->references == 0 ){
+		// a kernel thread may still be running on the space being freed,
+		// so move off of it before the page directory goes away. small
+		// spaces don't reload CR3, so the directory can still be loaded
+		// after another space became active.
+		if ( space == active_space
+		  || (!space->small_base
+		      && space->page_dir_phys == page_dir_loaded_phys( )))
+		{
+			addr_space_set( kernel_space );
+		}
 
-	memset( map->map + index, 0, sizeof( addr_entry_t ));
-	map->used++;
-}
+		if ( space->small_base ){
+			addr_space_free_small( space );
+
+		} else {
+			// the directory isn't loaded anymore, so rather than unmapping
+			// each entry the whole user part of it is thrown away
+			for ( addr_entry_t *ent = addr_map_first( space->map );
+			      ent;
+			      ent = addr_map_next( ent ))
+			{
+				addr_entry_release( ent );
+			}
+
+			page_dir_free_user_tables( space->page_dir );
+			region_free( space->region, space->page_dir );
+		}
 
-static inline void addr_map_shift_downwards( addr_map_t *map, unsigned index ){
-	for ( unsigned i = index; i < map->used; i++ ){
-		map->map[i] = map->map[i + 1];
+		addr_map_free( space->map );
+		slab_free( &addr_space_slab, space );
 	}
-
-	//memset( map->map + index, 0, sizeof( addr_entry_t ));
-	map->used--;
 }
 
-addr_entry_t *addr_map_lookup( addr_map_t *map, unsigned long address ){
-	for ( unsigned i = 0; i < map->used; i++ ){
-		unsigned long start = map->map[i].virtual;
-		unsigned long end   = start + map->map[i].size * PAGE_SIZE;
+void addr_space_set( addr_space_t *space ){
+	if ( space->small_base ){
+		// small spaces are mapped in every page directory, so whichever
+		// directory is loaded can stay loaded
+		page_set_user_window( space->small_base, SMALL_SPACE_SIZE );
 
-		if ( address >= start && address < end ){
-			return map->map + i;
-		}
+	} else {
+		page_set_user_window( 0, SMALL_SPACE_BASE );
+		page_dir_load_phys( space->page_dir_phys );
 	}
 
-	return NULL;
+	active_space = space;
 }
 
-addr_entry_t *addr_map_split( addr_map_t *map,
-                              addr_entry_t *entry,
-                              unsigned long offset )
-{
-	if ( !entry ){
-		return NULL;
-	}
+addr_space_t *addr_space_active( void ){
+	return active_space;
+}
 
-	addr_entry_t temp = *entry;
+// translates a user address range in the given space into the linear
+// addresses the kernel sees, returning 0 if any part of the range is
+// outside what the space can access
+uintptr_t addr_space_user_linear( addr_space_t *space,
+                                  uintptr_t address,
+                                  unsigned long size )
+{
+	uintptr_t limit = space->small_base? SMALL_SPACE_SIZE : SMALL_SPACE_BASE;
 
-	temp.virtual  += offset * PAGE_SIZE;
-	temp.physical += offset * PAGE_SIZE;
-	temp.size     -= offset;
-	entry->size    = offset;
+	if ( address == 0 || address >= limit || size > limit - address ){
+		return 0;
+	}
 
-	return addr_map_insert( map, &temp );
+	return space->small_base + address;
 }
 
-// "carve" out an entry from the middle of another existing entry
-addr_entry_t *addr_map_carve( addr_map_t *map, addr_entry_t *entry ){
-	addr_entry_t *temp = addr_map_lookup( map, entry->virtual );
-	addr_entry_t *ret  = NULL;
+int addr_space_map( addr_space_t *a,
+                    addr_space_t *b,
+                    addr_entry_t *ent );
 
+int addr_space_grant( addr_space_t *a,
+                      addr_space_t *b,
+                      addr_entry_t *ent );
 
-	if ( !temp ){
-		return NULL;
+bool addr_space_cow_fault( addr_space_t *space, uintptr_t address ){
+	uintptr_t page    = address & ~(PAGE_SIZE - 1);
+	addr_entry_t *ent = space? addr_map_lookup( space->map, page ) : NULL;
+
+	if ( !ent ){
+		return false;
 	}
 
-	uintptr_t off = (uintptr_t)entry->virtual - (uintptr_t)temp->virtual;
-	off = off / PAGE_SIZE;
+	uintptr_t offset = page - (ent->virtual & ~(PAGE_SIZE - 1));
+	uintptr_t frame  = (ent->physical & ~(PAGE_SIZE - 1)) + offset;
 
-	// check to see if the requested region can actually be sliced out,
-	// if it's larger then return NULL to signal an error
-	if ( entry->size > temp->size - off ){
-		return NULL;
-	}
+	// the page is about to get a frame of its own, so give it an entry
+	// of its own first, while that can still fail cleanly
+	if ( phys_frame_is_shared( frame )){
+		addr_entry_t temp = (addr_entry_t){
+			.virtual = page,
+			.size    = 1,
+		};
+
+		ent = addr_map_carve( space->map, &temp );
 
-	if ( off != 0 ){
-		temp = addr_map_split( map, temp, off );
+		if ( !ent ){
+			return false;
+		}
 	}
 
-	ret = temp;
+	uintptr_t phys = page_cow_fault( (void *)page );
 
+	if ( !phys ){
+		return false;
+	}
 
-	if ( entry->size < temp->size ){
-		temp = addr_map_split( map, temp, entry->size );
+	if ( phys != frame ){
+		ent->physical = phys;
+		ent->source   = ADDR_ENTRY_SOURCE_OWNED;
 	}
 
-	return ret;
+	return true;
 }
 
-void addr_map_remove( addr_map_t *map, addr_entry_t *entry ){
-	unsigned index = ((uintptr_t)entry - (uintptr_t)map->map) / sizeof(*entry);
+int addr_space_unmap( addr_space_t *space, unsigned long address ){
+	return 0;
+}
 
-	KASSERT( index <= ADDR_MAP_ENTRIES_PER_PAGE );
-	debug_printf( "removing index %u\n", index );
+// the space takes over the entry's frame references. if the entry can't
+// be added, nothing is left mapped and the references are dropped.
+int addr_space_insert_map( addr_space_t *space, addr_entry_t *ent ){
+	uintptr_t v_start = ent->virtual  - (ent->virtual  % PAGE_SIZE);
+	uintptr_t p_start = ent->physical - (ent->physical % PAGE_SIZE);
+	addr_entry_t *inserted = addr_map_insert( space->map, ent );
 
-	addr_map_shift_downwards( map, index );
-}
+	if ( !inserted ){
+		debug_log( DEBUG_LEVEL_ERROR,
+		           "couldn't allocate a map entry for 0x%x\n", v_start );
+		addr_entry_release( ent );
+		return -1;
+	}
 
-addr_entry_t *addr_map_insert( addr_map_t *map, addr_entry_t *entry ){
-	if ( map->used >= map->entries || !entry ){
-		return NULL;
+	if ( !map_phys_range( ent->permissions, (void *)v_start,
+	                      (void *)p_start, ent->size ))
+	{
+		debug_log( DEBUG_LEVEL_ERROR,
+		           "couldn't allocate page tables to map 0x%x\n", v_start );
+
+		// some of the range may have been mapped before running out
+		unmap_phys_range( (void *)v_start, ent->size );
+		addr_map_remove( space->map, inserted );
+		addr_entry_release( ent );
+		return -1;
 	}
 
-	int placement = -1;
+	phys_reserve_range( p_start, p_start + ent->size * PAGE_SIZE );
 
-	// traverse entry list looking for a place to insert the node,
-	// leaving -1 in 'placement' if the node should be placed at the end 
-	for ( unsigned i = 0; i < map->used; i++ ){
-		unsigned long start = map->map[i].virtual;
+	return 0;
+}
 
-		if ( entry->virtual < start ){
-			placement = i;
-			break;
-		}
-	}
+int addr_space_remove_map( addr_space_t *space, addr_entry_t *ent ){
+	uintptr_t v_start = ent->virtual  - (ent->virtual  % PAGE_SIZE);
 
-	if ( placement >= 0 ){
-		addr_map_shift_upwards( map, placement );
+	debug_log( DEBUG_LEVEL_TRACE, "removing mapping 0x%x of size %u\n",
+	           v_start, ent->size );
 
-	} else {
-		placement = map->used;
-		map->used += 1;
-	}
+	unmap_phys_range( (void *)v_start, ent->size );
 
-	addr_entry_t *ret = map->map + placement;
-	*ret = *entry;
-	return ret;
+	addr_entry_release( ent );
+	addr_map_remove( space->map, ent );
+
+	return 0;
 }
@@ -0,0 +1,116 @@
+#include <c4/mm/kmalloc.h>
+#include <c4/mm/region.h>
+#include <c4/mm/slab.h>
+#include <c4/klib/bitmap.h>
+#include <c4/klib/string.h>
+#include <c4/paging.h>
+#include <c4/debug.h>
+#include <c4/common.h>
+
+// small allocations come from single page slabs, so they're never page
+// aligned and their block header is always at the start of their page.
+// page aligned pointers are large allocations, with the last page of each
+// one marked in large_ends so kfree() can find its size.
+static slab_t       kmalloc_slabs[KMALLOC_CLASSES];
+static const char  *kmalloc_names[KMALLOC_CLASSES] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024",
+};
+static bitmap_ent_t large_ends[BITMAP_WORDS( REGION_GLOBAL_MAX_PAGES )];
+static bool         initialized = false;
+
+static void kmalloc_init( void ){
+	for ( unsigned i = 0; i < KMALLOC_CLASSES; i++ ){
+		slab_init_aligned_at( kmalloc_slabs + i, kmalloc_names[i],
+		                      region_get_global( ),
+		                      KMALLOC_MIN_SIZE << i, SLAB_MIN_ALIGN,
+		                      SLAB_FLAG_SINGLE_PAGE, NO_CTOR, NO_DTOR );
+	}
+
+	initialized = true;
+}
+
+static inline unsigned kmalloc_class( size_t size ){
+	unsigned ret = 0;
+
+	while ( ((size_t)KMALLOC_MIN_SIZE << ret) < size ){
+		ret++;
+	}
+
+	return ret;
+}
+
+static void *kmalloc_large( size_t size ){
+	region_t *region = region_get_global( );
+	unsigned pages   = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	uint8_t *ret     = region_alloc_span( region, pages );
+
+	if ( ret ){
+		unsigned n = (ret - (uint8_t *)region->vaddress) / PAGE_SIZE;
+
+		bitmap_set( large_ends, n + pages - 1 );
+	}
+
+	return ret;
+}
+
+static void kfree_large( void *ptr ){
+	region_t *region = region_get_global( );
+	unsigned n = ((uint8_t *)ptr - (uint8_t *)region->vaddress) / PAGE_SIZE;
+	int end    = bitmap_first_set( large_ends, n, region->num_pages );
+
+	if ( end < 0 ){
+		debug_printf( "warning: kfree() of unknown pointer %p\n", ptr );
+		return;
+	}
+
+	bitmap_unset( large_ends, end );
+	region_free_span( region, ptr, end - n + 1 );
+}
+
+void *kmalloc( size_t size ){
+	if ( !initialized ){
+		kmalloc_init( );
+	}
+
+	if ( size > KMALLOC_MAX_SIZE ){
+		return kmalloc_large( size );
+	}
+
+	return slab_alloc( kmalloc_slabs + kmalloc_class( size ));
+}
+
+void *kzalloc( size_t size ){
+	void *ret = kmalloc( size );
+
+	if ( ret ){
+		memset( ret, 0, size );
+	}
+
+	return ret;
+}
+
+void kfree( void *ptr ){
+	uintptr_t addr = (uintptr_t)ptr;
+
+	if ( !ptr ){
+		return;
+	}
+
+	if ( (addr & (PAGE_SIZE - 1)) == 0 ){
+		kfree_large( ptr );
+		return;
+	}
+
+	slab_blk_t *block = (void *)(addr & ~(PAGE_SIZE - 1));
+
+	if ( block->magic != MAGIC
+	     || block->slab < kmalloc_slabs
+	     || block->slab >= kmalloc_slabs + KMALLOC_CLASSES )
+	{
+		debug_printf( "warning: kfree() of unknown pointer %p\n", ptr );
+		return;
+	}
+
+	slab_free( block->slab, ptr );
+}
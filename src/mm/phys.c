@@ -0,0 +1,412 @@
+#include <c4/mm/phys.h>
+#include <c4/mm/stats.h>
+#include <c4/arch/earlyheap.h>
+#include <c4/klib/bitmap.h>
+#include <c4/klib/string.h>
+#include <c4/paging.h>
+#include <c4/debug.h>
+#include <c4/common.h>
+
+// physical frames are managed with a binary buddy allocator. each order has
+// a bitmap with one bit per block of that size, set when the block is free,
+// so a free frame is covered by exactly one set bit across all the orders.
+// nothing is stored in the frames themselves, which don't need to be mapped.
+typedef struct phys_order {
+	bitmap_ent_t *free_map;
+	unsigned      blocks;
+	unsigned      free_blocks;
+	// every word in free_map before this one is known to be empty
+	unsigned      hint;
+} phys_order_t;
+
+static phys_order_t orders[PHYS_MAX_ORDER];
+// bits are set for pages of usable ram, anything else is never handed out
+static bitmap_ent_t *usable_map;
+// references to each page beyond the first, pages shared between address
+// spaces aren't freed until every reference has been dropped
+static uint16_t *frame_refs;
+
+// recently freed single pages are kept on a small stack and handed out
+// again first, since they're likely still in cache. it's refilled from and
+// drained to the buddy allocator in batches.
+typedef struct phys_page_cache {
+	uintptr_t pages[PHYS_CACHE_SIZE];
+	unsigned  count;
+} phys_page_cache_t;
+
+// TODO: this will need to be per-cpu once SMP is working
+static phys_page_cache_t page_cache;
+
+static unsigned phys_pages   = 0;
+static unsigned usable_pages = 0;
+static unsigned free_pages   = 0;
+// pages taken out of the free pool by phys_reserve_range()
+static unsigned reserved_pages = 0;
+
+static inline bool block_is_free( unsigned order, uintptr_t block ){
+	return block < orders[order].blocks
+	    && bitmap_get( orders[order].free_map, block );
+}
+
+static inline void block_set_free( unsigned order, uintptr_t block ){
+	phys_order_t *ord = orders + order;
+
+	bitmap_set( ord->free_map, block );
+	ord->free_blocks++;
+
+	if ( block / BITMAP_BPS < ord->hint ){
+		ord->hint = block / BITMAP_BPS;
+	}
+}
+
+static inline void block_set_used( unsigned order, uintptr_t block ){
+	bitmap_unset( orders[order].free_map, block );
+	orders[order].free_blocks--;
+}
+
+static inline bool page_is_usable( uintptr_t index ){
+	return index < phys_pages && bitmap_get( usable_map, index );
+}
+
+// returns the first free block of the given order
+static uintptr_t block_find_free( unsigned order ){
+	phys_order_t *ord = orders + order;
+	unsigned words = ord->blocks / BITMAP_BPS + 1;
+
+	for ( unsigned i = ord->hint; i < words; i++ ){
+		if ( ord->free_map[i] ){
+			ord->hint = i;
+			return i * BITMAP_BPS + bitmap_ctz( ord->free_map[i] );
+		}
+	}
+
+	// free_blocks said there was one
+	KASSERT( false );
+	return 0;
+}
+
+// returns the order of the free block containing the page, and its first
+// page in 'base', or -1 if the page isn't free
+static int block_find_containing( uintptr_t index, uintptr_t *base ){
+	for ( unsigned order = 0; order < PHYS_MAX_ORDER; order++ ){
+		if ( block_is_free( order, index >> order )){
+			*base = index & ~(((uintptr_t)1 << order) - 1);
+			return order;
+		}
+	}
+
+	return -1;
+}
+
+// frees a block, merging it with its buddy for as long as the buddy is free
+static void block_free( uintptr_t index, unsigned order ){
+	while ( order + 1 < PHYS_MAX_ORDER ){
+		uintptr_t buddy = index ^ ((uintptr_t)1 << order);
+
+		if ( !block_is_free( order, buddy >> order )){
+			break;
+		}
+
+		block_set_used( order, buddy >> order );
+		index &= ~((uintptr_t)1 << order);
+		order++;
+	}
+
+	block_set_free( order, index >> order );
+}
+
+// frees a run of pages [index, end) in the largest aligned blocks possible
+static void free_page_run( uintptr_t index, uintptr_t end ){
+	while ( index < end ){
+		unsigned order = 0;
+
+		while ( order + 1 < PHYS_MAX_ORDER
+		     && (index & ((2 << order) - 1)) == 0
+		     && index + (2 << order) <= end )
+		{
+			order++;
+		}
+
+		block_free( index, order );
+		free_pages += 1 << order;
+		index      += 1 << order;
+	}
+}
+
+void phys_init( uintptr_t mem_end ){
+	phys_pages   = mem_end / PAGE_SIZE;
+	usable_pages = 0;
+	free_pages   = 0;
+
+	for ( unsigned i = 0; i < PHYS_MAX_ORDER; i++ ){
+		unsigned blocks = phys_pages >> i;
+		unsigned size   = (blocks / BITMAP_BPS + 1) * sizeof( bitmap_ent_t );
+
+		orders[i].free_map    = kealloc( size );
+		orders[i].blocks      = blocks;
+		orders[i].free_blocks = 0;
+		orders[i].hint        = 0;
+
+		memset( orders[i].free_map, 0, size );
+	}
+
+	unsigned size = (phys_pages / BITMAP_BPS + 1) * sizeof( bitmap_ent_t );
+	usable_map = kealloc( size );
+	memset( usable_map, 0, size );
+
+	frame_refs = kealloc( phys_pages * sizeof( uint16_t ));
+	memset( frame_refs, 0, phys_pages * sizeof( uint16_t ));
+}
+
+void phys_add_range( uintptr_t start, uintptr_t end ){
+	uintptr_t index     = (start + PAGE_SIZE - 1) / PAGE_SIZE;
+	uintptr_t end_index = end / PAGE_SIZE;
+	uintptr_t run_start = index;
+
+	if ( end_index > phys_pages ){
+		end_index = phys_pages;
+	}
+
+	// ranges can overlap, so only add pages that aren't usable already
+	for ( ; index < end_index; index++ ){
+		if ( bitmap_get( usable_map, index )){
+			free_page_run( run_start, index );
+			run_start = index + 1;
+			continue;
+		}
+
+		bitmap_set( usable_map, index );
+		usable_pages++;
+	}
+
+	free_page_run( run_start, end_index );
+}
+
+uintptr_t phys_alloc( unsigned order ){
+	for ( unsigned k = order; k < PHYS_MAX_ORDER; k++ ){
+		if ( orders[k].free_blocks == 0 ){
+			continue;
+		}
+
+		uintptr_t block = block_find_free( k );
+		uintptr_t index = block << k;
+
+		block_set_used( k, block );
+
+		// split the block down to the requested size, freeing the upper
+		// half at each step
+		while ( k > order ){
+			k--;
+			block_set_free( k, (index >> k) + 1 );
+		}
+
+		free_pages -= 1 << order;
+
+		return index * PAGE_SIZE;
+	}
+
+	return 0;
+}
+
+void phys_free( uintptr_t addr, unsigned order ){
+	uintptr_t index = addr / PAGE_SIZE;
+	uintptr_t base;
+
+	if ( !page_is_usable( index )){
+		return;
+	}
+
+	if ( block_find_containing( index, &base ) >= 0 ){
+		debug_printf( "warning: double free of physical page 0x%x\n", addr );
+		return;
+	}
+
+	block_free( index, order );
+	free_pages += 1 << order;
+}
+
+static bool page_cache_contains( phys_page_cache_t *cache, uintptr_t addr ){
+	for ( unsigned i = 0; i < cache->count; i++ ){
+		if ( cache->pages[i] == addr ){
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// removes cached pages in [start, end), they're already marked as used
+// in the buddy maps so there's nothing else to do with them
+static unsigned page_cache_purge( phys_page_cache_t *cache,
+                                  uintptr_t start, uintptr_t end )
+{
+	unsigned kept = 0;
+	unsigned ret  = cache->count;
+
+	for ( unsigned i = 0; i < cache->count; i++ ){
+		if ( cache->pages[i] < start || cache->pages[i] >= end ){
+			cache->pages[kept++] = cache->pages[i];
+		}
+	}
+
+	cache->count = kept;
+
+	return ret - kept;
+}
+
+uintptr_t phys_page_alloc( void ){
+	phys_page_cache_t *cache = &page_cache;
+
+	if ( cache->count == 0 ){
+		while ( cache->count < PHYS_CACHE_BATCH ){
+			uintptr_t page = phys_alloc( 0 );
+
+			if ( !page ){
+				break;
+			}
+
+			cache->pages[cache->count++] = page;
+		}
+
+		if ( cache->count == 0 ){
+			return 0;
+		}
+	}
+
+	return cache->pages[--cache->count];
+}
+
+// returns true if the page was actually freed
+static bool page_cache_free( uintptr_t addr ){
+	phys_page_cache_t *cache = &page_cache;
+	uintptr_t base;
+
+	if ( !page_is_usable( addr / PAGE_SIZE )){
+		return false;
+	}
+
+	if ( block_find_containing( addr / PAGE_SIZE, &base ) >= 0
+	     || page_cache_contains( cache, addr ))
+	{
+		debug_printf( "warning: double free of physical page 0x%x\n", addr );
+		return false;
+	}
+
+	// the bottom of the stack is the least recently freed, so give those
+	// back when the cache is full
+	if ( cache->count == PHYS_CACHE_SIZE ){
+		for ( unsigned i = 0; i < PHYS_CACHE_BATCH; i++ ){
+			phys_free( cache->pages[i], 0 );
+		}
+
+		cache->count -= PHYS_CACHE_BATCH;
+
+		for ( unsigned i = 0; i < cache->count; i++ ){
+			cache->pages[i] = cache->pages[i + PHYS_CACHE_BATCH];
+		}
+	}
+
+	cache->pages[cache->count++] = addr;
+
+	return true;
+}
+
+void phys_page_free( uintptr_t addr ){
+	page_cache_free( addr );
+}
+
+void phys_reserve_range( uintptr_t start, uintptr_t end ){
+	uintptr_t index     = start / PAGE_SIZE;
+	uintptr_t end_index = (end + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	reserved_pages += page_cache_purge( &page_cache, index * PAGE_SIZE,
+	                                    end_index * PAGE_SIZE );
+
+	if ( end_index > phys_pages ){
+		end_index = phys_pages;
+	}
+
+	while ( index < end_index ){
+		uintptr_t base;
+		int order = block_find_containing( index, &base );
+
+		if ( order < 0 ){
+			index++;
+			continue;
+		}
+
+		uintptr_t block_end = base + ((uintptr_t)1 << order);
+		uintptr_t next      = (block_end < end_index)? block_end : end_index;
+
+		// take the whole block, then give back whatever part of it is
+		// outside the range
+		block_set_used( order, base >> order );
+		free_pages     -= 1 << order;
+		reserved_pages += next - index;
+
+		free_page_run( base, index );
+		free_page_run( next, block_end );
+
+		index = next;
+	}
+}
+
+void phys_release_range( uintptr_t start, uintptr_t end ){
+	for ( uintptr_t addr = start; addr < end; addr += PAGE_SIZE ){
+		if ( phys_frame_unref( addr )
+		     && page_cache_free( addr ) && reserved_pages > 0 )
+		{
+			reserved_pages--;
+		}
+	}
+}
+
+void phys_frame_ref( uintptr_t addr ){
+	uintptr_t index = addr / PAGE_SIZE;
+
+	if ( page_is_usable( index )){
+		KASSERT( frame_refs[index] < 0xffff );
+		frame_refs[index]++;
+	}
+}
+
+bool phys_frame_unref( uintptr_t addr ){
+	uintptr_t index = addr / PAGE_SIZE;
+
+	if ( page_is_usable( index ) && frame_refs[index] > 0 ){
+		frame_refs[index]--;
+		return false;
+	}
+
+	return true;
+}
+
+bool phys_frame_is_shared( uintptr_t addr ){
+	uintptr_t index = addr / PAGE_SIZE;
+
+	return page_is_usable( index ) && frame_refs[index] > 0;
+}
+
+unsigned phys_total_pages( void ){
+	return usable_pages;
+}
+
+unsigned phys_free_pages( void ){
+	return free_pages + page_cache.count;
+}
+
+void phys_get_stats( mem_phys_stats_t *stats ){
+	stats->total_pages        = usable_pages;
+	stats->free_pages         = free_pages + page_cache.count;
+	stats->cached_pages       = page_cache.count;
+	stats->reserved_pages     = reserved_pages;
+	stats->page_table_pages   = 0;
+	stats->largest_free_order = -1;
+
+	for ( int i = PHYS_MAX_ORDER - 1; i >= 0; i-- ){
+		if ( orders[i].free_blocks ){
+			stats->largest_free_order = i;
+			break;
+		}
+	}
+}
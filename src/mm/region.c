@@ -1,62 +1,159 @@
 #include <c4/mm/region.h>
 #include <c4/paging.h>
+#include <c4/debug.h>
+#include <c4/common.h>
 #include <stdint.h>
 #include <stdbool.h>
 
-void *region_alloc( region_t *region ){
-	if ( region->available == 0 ){
-		return (void *)0;
+// a region hands out page-granular spans of a range of kernel virtual
+// memory, mapping fresh physical pages behind them. page tables for the
+// range are created as they're first needed, so a region can cover far
+// more address space than it has memory behind it.
+//
+// small spans are the common case (stacks, page directories, slab pages),
+// so those are cached by size when freed and reused while still mapped,
+// which saves the unmap/remap and the TLB invalidation in between.
+
+static void region_unmap_span( region_t *region, void *addr, unsigned pages ){
+	uintptr_t n = (uintptr_t)((uint8_t *)addr - (uint8_t *)region->vaddress)
+	              / PAGE_SIZE;
+
+	unmap_range( addr, pages );
+	hbitmap_unset_range( &region->map, n, pages );
+	region->available += pages;
+}
+
+void region_drain( region_t *region ){
+	for ( unsigned i = 0; i < REGION_QCACHE_MAX; i++ ){
+		region_qcache_t *cache = region->qcache + i;
+
+		while ( cache->count > 0 ){
+			region_unmap_span( region, cache->spans[--cache->count], i + 1 );
+		}
+	}
+}
+
+void *region_alloc_span( region_t *region, unsigned pages ){
+	if ( pages == 0 ){
+		return NULL;
+	}
+
+	if ( pages <= REGION_QCACHE_MAX ){
+		region_qcache_t *cache = region->qcache + pages - 1;
+
+		if ( cache->count > 0 ){
+			return cache->spans[--cache->count];
+		}
+	}
+
+	// spans that are a power of two in size are aligned to their size,
+	// so the slab allocator can find a block header from any address in it
+	unsigned align = (pages & (pages - 1))? 1 : pages;
+	int n = hbitmap_first_free_run( &region->map, pages, align );
+
+	if ( n < 0 ){
+		// cached spans might be what's fragmenting the region
+		region_drain( region );
+		n = hbitmap_first_free_run( &region->map, pages, align );
+	}
+
+	if ( n < 0 ){
+		return NULL;
 	}
 
-	int n = bitmap_first_free( region->bitmap, region->num_pages );
-	void *addr = (uint8_t *)region->vaddress + n * PAGE_SIZE;
+	uint8_t *addr = (uint8_t *)region->vaddress + n * PAGE_SIZE;
 
-	map_page( region->page_flags, addr );
-	bitmap_set( region->bitmap, n );
-	region->available--;
+	hbitmap_set_range( &region->map, n, pages );
+	region->available -= pages;
+
+	for ( unsigned i = 0; i < pages; i++ ){
+		if ( !map_page( region->page_flags, addr + i * PAGE_SIZE )){
+			// out of physical memory, unmapping pages that were never
+			// mapped is harmless
+			region_unmap_span( region, addr, pages );
+			return NULL;
+		}
+	}
 
 	return addr;
 }
 
+void region_free_span( region_t *region, void *addr, unsigned pages ){
+	if ( pages <= REGION_QCACHE_MAX ){
+		region_qcache_t *cache = region->qcache + pages - 1;
+
+		if ( cache->count < REGION_QCACHE_SIZE ){
+			cache->spans[cache->count++] = addr;
+			return;
+		}
+	}
+
+	region_unmap_span( region, addr, pages );
+}
+
+void *region_alloc( region_t *region ){
+	return region_alloc_span( region, 1 );
+}
+
 void region_free( region_t *region, void *page ){
-	uintptr_t n = (uintptr_t)(page - region->vaddress) / PAGE_SIZE;
+	region_free_span( region, page, 1 );
+}
 
-	unmap_page( page );
-	bitmap_unset( region->bitmap, n );
-	region->available++;
+void region_get_stats( region_t *region, mem_region_stats_t *stats ){
+	stats->total_pages      = region->num_pages;
+	stats->available_pages  = region->available;
+	stats->cached_pages     = 0;
+	stats->largest_free_run = bitmap_largest_free_run( region->map.map,
+	                                                   region->num_pages );
+
+	for ( unsigned i = 0; i < REGION_QCACHE_MAX; i++ ){
+		stats->cached_pages += region->qcache[i].count * (i + 1);
+	}
 }
 
 region_t *region_init_at( region_t     *region,
                           void         *vaddress,
                           bitmap_ent_t *bitmap,
+                          bitmap_ent_t *summary,
                           unsigned     num_pages,
                           unsigned     page_flags )
 {
-	region->bitmap     = bitmap;
 	region->vaddress   = vaddress;
 	region->num_pages  = num_pages;
 	region->available  = num_pages;
 	region->page_flags = page_flags;
 
-	// make sure every entry in the bitmap is clear
-	for ( unsigned i = 0; i < num_pages; i++ ){
-		bitmap_unset( bitmap, i );
+	hbitmap_init( &region->map, bitmap, summary, num_pages );
+
+	for ( unsigned i = 0; i < REGION_QCACHE_MAX; i++ ){
+		region->qcache[i].count = 0;
 	}
 
 	return region;
 }
 
-static bitmap_ent_t region_map[32];
+static bitmap_ent_t region_map[BITMAP_WORDS( REGION_GLOBAL_MAX_PAGES )];
+static bitmap_ent_t region_summary[HBITMAP_SUMMARY_WORDS( REGION_GLOBAL_MAX_PAGES )];
 static region_t     global_region;
 static bool         initialized = false;
 
-void region_init_global( void *addr ){
+void region_init_global( void *addr, unsigned num_pages ){
+	KASSERT( num_pages <= REGION_GLOBAL_MAX_PAGES );
+
 	if ( !initialized ){
-		//region_init_at( &global_region, (void*)0xc1000000, region_map,
-		region_init_at( &global_region, addr, region_map,
-		                32 * BITMAP_BPS,
+		region_init_at( &global_region, addr, region_map, region_summary,
+		                num_pages,
 		                PAGE_READ | PAGE_WRITE | PAGE_SUPERVISOR );
 
+		// kernel stacks and thread structures come from here, and a fault
+		// on the kernel stack can't be handled, so every directory needs
+		// the heap's page tables before it's first loaded
+		void *end = (uint8_t *)addr + num_pages * PAGE_SIZE;
+
+		if ( !page_dir_prealloc_shared( addr, end )){
+			debug_printf( "warning: couldn't allocate kernel heap page tables\n" );
+		}
+
 		initialized = true;
 	}
 }
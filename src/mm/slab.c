@@ -1,5 +1,6 @@
 #include <c4/mm/region.h>
 #include <c4/mm/slab.h>
+#include <c4/mm/stats.h>
 #include <c4/klib/string.h>
 #include <c4/paging.h>
 #include <c4/debug.h>
@@ -54,16 +55,45 @@ static inline slab_blk_t *slab_pop_block( slab_list_t *list ){
 	return temp;
 }
 
+static inline unsigned slab_block_size( slab_t *slab ){
+	return slab->block_pages * PAGE_SIZE;
+}
+
+// offset of the first object in a block, before colouring
+static inline unsigned slab_objs_offset( slab_t *slab ){
+	return (sizeof( slab_blk_t ) + slab->align - 1) & ~(slab->align - 1);
+}
+
 static inline slab_blk_t *slab_alloc_block( slab_t *slab ){
-	slab_blk_t *blk = region_alloc( slab->region );
+	slab_blk_t *blk = region_alloc_span( slab->region, slab->block_pages );
+
+	if ( !blk ){
+		return NULL;
+	}
+
+	blk->magic    = MAGIC;
+	blk->slab     = slab;
+	blk->list     = NULL;
+	blk->in_use   = 0;
+	blk->freelist = NULL;
+
+	uint8_t *objs = (uint8_t *)blk + slab_objs_offset( slab ) + slab->colour;
+
+	// link objects in address order, so allocations walk forward
+	// through the block
+	for ( unsigned i = slab->objs_per_block; i > 0; i-- ){
+		slab_free_obj_t *obj = (void *)(objs + (i - 1) * slab->obj_size);
 
-	blk->magic = 0xabadc0de;
-	blk->map   = 0;
-	blk->slab  = slab;
-	blk->list  = (void *)0;
+		obj->next     = blk->freelist;
+		blk->freelist = obj;
+	}
+
+	slab->colour += SLAB_COLOUR_STEP;
+	if ( slab->colour > slab->colour_max ){
+		slab->colour = 0;
+	}
 
-	bitmap_set( &blk->map, 0 );
-	slab->total_pages++;
+	slab->total_pages += slab->block_pages;
 
 	return blk;
 }
@@ -72,17 +102,16 @@ static inline void slab_dealloc_free_block( slab_t *slab ){
 	if ( slab->free.size > MAX_FREE_SLABS ){
 		slab_blk_t *block = slab_pop_block( &slab->free );
 
-		debug_printf( "freeing spare page %p\n", block );
-
-		region_free( slab->region, block );
+		block->magic = 0;
+		slab->total_pages -= slab->block_pages;
+		region_free_span( slab->region, block, slab->block_pages );
 	}
 }
 
-void *slab_alloc( slab_t *slab ){
-	bool      retried = false;
-	slab_blk_t *block = (void *)0;
+// takes an object from the block lists, without running the constructor
+static void *slab_alloc_obj( slab_t *slab ){
+	slab_blk_t *block;
 
-retry:
 	if ( slab->partial.first ){
 		block = slab->partial.first;
 
@@ -90,104 +119,408 @@ retry:
 		block = slab->free.first;
 
 	} else {
-		slab_blk_t *temp = slab_alloc_block( slab );
+		block = slab_alloc_block( slab );
 
-		slab_move_block( temp, &slab->free );
-		if ( !retried ){
-			debug_printf( "allocated new block %p, retrying...\n", temp );
-			retried = true;
-			goto retry;
+		if ( !block ){
+			return NULL;
 		}
+
+		slab_insert_block( block, &slab->free );
 	}
 
-	if ( block ){
-		int n = bitmap_first_free( &block->map, BITMAP_BPS );
-		uintptr_t addr = (uintptr_t)block + n * slab->obj_size;
+	slab_free_obj_t *obj = block->freelist;
 
-		debug_printf( "bitmap: 0x%x, location: %u, pages: %u\n",
-			block->map, n, slab->total_pages );
+	block->freelist = obj->next;
+	block->in_use++;
+	slab->objs_out++;
 
-		bitmap_set( &block->map, n );
+	if ( !block->freelist ){
+		slab_move_block( block, &slab->full );
 
-		if ( block->map == BITMAP_ENT_FULL ){
-			slab_move_block( block, &slab->full );
+	} else if ( block->list == &slab->free ){
+		slab_move_block( block, &slab->partial );
+	}
 
-		} else if ( block->list == &slab->free ){
-			slab_move_block( block, &slab->partial );
-		}
+	return obj;
+}
 
-		// run the constructor, if there is one
-		slab->ctor? slab->ctor( (void *)addr ) : 0;
+// returns the block an object is in, or NULL if the object doesn't belong
+// to the slab
+static inline slab_blk_t *slab_obj_block( slab_t *slab, void *ptr ){
+	uintptr_t temp    = (uintptr_t)ptr;
+	slab_blk_t *block = (void *)(temp & ~((uintptr_t)slab_block_size( slab ) - 1));
 
-		return (void *)addr;
+	if ( block->magic != MAGIC || block->slab != slab ){
+		debug_printf( "bad magic! corrupted block or bad address at %p?", ptr );
+		return NULL;
 	}
 
-	return (void *)0;
+	return block;
 }
 
-void slab_free( slab_t *slab, void *ptr ){
+// returns an object to its block, without running the destructor
+static void slab_free_obj( slab_t *slab, void *ptr ){
 	if ( ptr ){
-		uintptr_t temp    = (uintptr_t)ptr;
-		uintptr_t addr    = temp / PAGE_SIZE * PAGE_SIZE;
-		uintptr_t pos     = (temp - addr) / (PAGE_SIZE / BITMAP_BPS);
-		slab_blk_t *block = (void *)addr;
+		slab_blk_t *block = slab_obj_block( slab, ptr );
+		slab_free_obj_t *obj = ptr;
 
-		if ( block->magic != MAGIC ){
-			debug_printf( "bad magic! corrupted block or bad address at %p?", ptr );
+		if ( !block ){
 			return;
 		}
 
-		// run the destructor, if there is one
-		slab->dtor? slab->dtor( (void *)addr ) : 0;
-		bitmap_unset( &block->map, pos );
+		obj->next       = block->freelist;
+		block->freelist = obj;
+		block->in_use--;
+		slab->objs_out--;
 
-		// test to see if there are any entries besides the first
-		// information block, and stuff it into the free list if not
-		if ( block->map == 1 ){
-			debug_printf( "moving block %p to free list\n", block );
+		if ( block->in_use == 0 ){
 			slab_move_block( block, &slab->free );
-
 			slab_dealloc_free_block( slab );
 
 		} else if ( block->list == &slab->full ){
-			debug_printf( "moving full block %p to partial list\n", block );
 			slab_move_block( block, &slab->partial );
 		}
 	}
 }
 
-static inline unsigned slab_adjust_size( unsigned size ){
-	unsigned min_size = PAGE_SIZE / BITMAP_BPS;
-	unsigned ret;
+static slab_t magazine_slab;
+static bool   magazine_slab_inited = false;
 
-	if ( size >= min_size ){
-		debug_printf( "warning: size of %u requested, "
-				"but only sizes less than %u supported atm",
-				size, min_size );
+static slab_magazine_t *slab_magazine_alloc( slab_t *slab ){
+	slab_magazine_t *mag = slab->depot.empty;
 
-		ret  = (size / min_size) * min_size;
-		ret += size % min_size;
+	if ( mag ){
+		slab->depot.empty = mag->next;
+		return mag;
+	}
 
-	} else {
-		ret = min_size;
+	if ( !magazine_slab_inited ){
+		slab_init_aligned_at( &magazine_slab, "slab_magazine",
+		                      region_get_global( ),
+		                      sizeof( slab_magazine_t ), SLAB_MIN_ALIGN,
+		                      SLAB_FLAG_NO_MAGAZINES, NO_CTOR, NO_DTOR );
+
+		magazine_slab_inited = true;
+	}
+
+	mag = slab_alloc( &magazine_slab );
+
+	if ( mag ){
+		mag->count = 0;
+		mag->next  = NULL;
+	}
+
+	return mag;
+}
+
+static void slab_magazine_empty( slab_t *slab, slab_magazine_t *mag ){
+	while ( mag->count > 0 ){
+		slab_free_obj( slab, mag->objs[--mag->count] );
+	}
+}
+
+static inline void swap_magazines( slab_cpu_cache_t *cpu ){
+	slab_magazine_t *temp = cpu->loaded;
+
+	cpu->loaded   = cpu->previous;
+	cpu->previous = temp;
+}
+
+// tries to get an object from the cpu's magazines, swapping in a full
+// magazine from the depot if needed
+static void *slab_magazine_pop( slab_t *slab ){
+	slab_cpu_cache_t *cpu = &slab->cpu;
+
+	if ( cpu->loaded && cpu->loaded->count > 0 ){
+		return cpu->loaded->objs[--cpu->loaded->count];
+	}
+
+	if ( cpu->previous && cpu->previous->count > 0 ){
+		swap_magazines( cpu );
+		return cpu->loaded->objs[--cpu->loaded->count];
+	}
+
+	if ( slab->depot.full ){
+		slab_magazine_t *mag = slab->depot.full;
+
+		slab->depot.full = mag->next;
+		slab->depot.full_count--;
+
+		// the previous magazine is empty at this point, so it goes back
+		// to the depot and the loaded one (also empty) takes its place
+		if ( cpu->previous ){
+			cpu->previous->next = slab->depot.empty;
+			slab->depot.empty   = cpu->previous;
+		}
+
+		cpu->previous = cpu->loaded;
+		cpu->loaded   = mag;
+
+		return mag->objs[--mag->count];
+	}
+
+	return NULL;
+}
+
+static bool slab_magazine_push( slab_t *slab, void *ptr ){
+	slab_cpu_cache_t *cpu = &slab->cpu;
+
+	if ( cpu->loaded && cpu->loaded->count < SLAB_MAGAZINE_SIZE ){
+		cpu->loaded->objs[cpu->loaded->count++] = ptr;
+		return true;
+	}
+
+	if ( cpu->previous && cpu->previous->count < SLAB_MAGAZINE_SIZE ){
+		swap_magazines( cpu );
+		cpu->loaded->objs[cpu->loaded->count++] = ptr;
+		return true;
+	}
+
+	slab_magazine_t *mag = slab_magazine_alloc( slab );
+
+	if ( !mag ){
+		return false;
+	}
+
+	// both magazines are full, the previous one goes to the depot and
+	// a new empty one is loaded
+	if ( cpu->previous ){
+		if ( slab->depot.full_count < SLAB_DEPOT_MAX ){
+			cpu->previous->next = slab->depot.full;
+			slab->depot.full    = cpu->previous;
+			slab->depot.full_count++;
+
+		} else {
+			slab_magazine_empty( slab, cpu->previous );
+			cpu->previous->next = slab->depot.empty;
+			slab->depot.empty   = cpu->previous;
+		}
+	}
+
+	cpu->previous = cpu->loaded;
+	cpu->loaded   = mag;
+	mag->objs[mag->count++] = ptr;
+
+	return true;
+}
+
+void *slab_alloc( slab_t *slab ){
+	void *ret = NULL;
+
+	if ( !(slab->flags & SLAB_FLAG_NO_MAGAZINES )){
+		ret = slab_magazine_pop( slab );
+	}
+
+	if ( !ret ){
+		ret = slab_alloc_obj( slab );
+	}
+
+	// run the constructor, if there is one
+	if ( ret && slab->ctor ){
+		slab->ctor( ret );
 	}
 
 	return ret;
 }
 
-slab_t *slab_init_at( slab_t   *slab,
-                      region_t *region,
-					  unsigned obj_size,
-                      void (*ctor)(void *ptr),
-                      void (*dtor)(void *ptr) )
+void slab_free( slab_t *slab, void *ptr ){
+	// objects from the wrong slab would otherwise sit in a magazine and
+	// be handed out again at the wrong size
+	if ( !ptr || !slab_obj_block( slab, ptr )){
+		return;
+	}
+
+	// run the destructor, if there is one
+	slab->dtor? slab->dtor( ptr ) : 0;
+
+	if ( (slab->flags & SLAB_FLAG_NO_MAGAZINES)
+	     || !slab_magazine_push( slab, ptr ))
+	{
+		slab_free_obj( slab, ptr );
+	}
+}
+
+static void slab_magazine_release( slab_magazine_t *mag ){
+	if ( mag ){
+		slab_free( &magazine_slab, mag );
+	}
+}
+
+void slab_drain( slab_t *slab ){
+	slab_magazine_t *mag;
+	slab_magazine_t *next;
+
+	for ( mag = slab->depot.full; mag; mag = next ){
+		next = mag->next;
+		slab_magazine_empty( slab, mag );
+		slab_magazine_release( mag );
+	}
+
+	for ( mag = slab->depot.empty; mag; mag = next ){
+		next = mag->next;
+		slab_magazine_release( mag );
+	}
+
+	slab->depot.full       = NULL;
+	slab->depot.empty      = NULL;
+	slab->depot.full_count = 0;
+
+	if ( slab->cpu.loaded ){
+		slab_magazine_empty( slab, slab->cpu.loaded );
+		slab_magazine_release( slab->cpu.loaded );
+	}
+
+	if ( slab->cpu.previous ){
+		slab_magazine_empty( slab, slab->cpu.previous );
+		slab_magazine_release( slab->cpu.previous );
+	}
+
+	slab->cpu.loaded   = NULL;
+	slab->cpu.previous = NULL;
+}
+
+// picks the smallest block size, in powers of two pages, that holds at
+// least SLAB_MIN_OBJS objects with under an eighth of the block wasted
+static void slab_fit_blocks( slab_t *slab ){
+	unsigned offset = slab_objs_offset( slab );
+
+	for ( slab->block_pages = 1;; slab->block_pages *= 2 ){
+		unsigned size  = slab_block_size( slab );
+		unsigned objs  = (size - offset) / slab->obj_size;
+		unsigned waste = size - offset - objs * slab->obj_size;
+
+		if ( slab->block_pages == SLAB_MAX_BLOCK_PAGES
+		     || (slab->flags & SLAB_FLAG_SINGLE_PAGE)
+		     || (objs >= SLAB_MIN_OBJS && waste <= size / 8 ))
+		{
+			slab->objs_per_block = objs;
+			slab->colour_max     = waste / SLAB_COLOUR_STEP * SLAB_COLOUR_STEP;
+
+			// colour offsets would break stricter alignment
+			if ( slab->align > SLAB_COLOUR_STEP ){
+				slab->colour_max = 0;
+			}
+
+			break;
+		}
+	}
+}
+
+// every initialized slab, for statistics
+static slab_t *slab_registry = NULL;
+
+static void slab_register( slab_t *slab ){
+	for ( slab_t *temp = slab_registry; temp; temp = temp->next_slab ){
+		if ( temp == slab ){
+			return;
+		}
+	}
+
+	slab->next_slab = slab_registry;
+	slab_registry   = slab;
+}
+
+slab_t *slab_init_aligned_at( slab_t   *slab,
+                              const char *name,
+                              region_t *region,
+                              unsigned obj_size,
+                              unsigned align,
+                              unsigned flags,
+                              void (*ctor)(void *ptr),
+                              void (*dtor)(void *ptr) )
 {
+	slab_t *next = slab->next_slab;
+
 	memset( slab, 0, sizeof( slab_t ));
 
-	slab->total_pages = 0;
-	slab->obj_size    = slab_adjust_size( obj_size );
+	// keep the registry link if the slab is being reinitialized
+	slab->next_slab = next;
+	slab->name      = name;
+	slab->req_size  = obj_size;
+
+	if ( align < SLAB_MIN_ALIGN ){
+		align = SLAB_MIN_ALIGN;
+	}
+
+	if ( obj_size < sizeof( slab_free_obj_t )){
+		obj_size = sizeof( slab_free_obj_t );
+	}
+
+	slab->flags       = flags;
+	slab->align       = align;
+	slab->obj_size    = (obj_size + align - 1) & ~(align - 1);
 	slab->ctor        = ctor;
 	slab->dtor        = dtor;
 	slab->region      = region;
 
+	slab_fit_blocks( slab );
+
+	// objects too big for even the largest blocks can't be allocated
+	KASSERT( slab->objs_per_block > 0 );
+
+	slab_register( slab );
+
 	return slab;
 }
+
+slab_t *slab_init_at( slab_t   *slab,
+                      const char *name,
+                      region_t *region,
+                      unsigned obj_size,
+                      void (*ctor)(void *ptr),
+                      void (*dtor)(void *ptr) )
+{
+	return slab_init_aligned_at( slab, name, region, obj_size,
+	                             SLAB_MIN_ALIGN, 0, ctor, dtor );
+}
+
+slab_t *slab_first( void ){
+	return slab_registry;
+}
+
+static unsigned magazine_objs( slab_magazine_t *mag ){
+	unsigned ret = 0;
+
+	for ( ; mag; mag = mag->next ){
+		ret += mag->count;
+	}
+
+	return ret;
+}
+
+void slab_get_stats( slab_t *slab, mem_slab_stats_t *stats ){
+	unsigned cached = magazine_objs( slab->depot.full );
+	unsigned blocks;
+	unsigned i;
+
+	if ( slab->cpu.loaded ){
+		cached += slab->cpu.loaded->count;
+	}
+
+	if ( slab->cpu.previous ){
+		cached += slab->cpu.previous->count;
+	}
+
+	for ( i = 0; slab->name && slab->name[i] && i < MEM_STATS_NAME_MAX - 1; i++ ){
+		stats->name[i] = slab->name[i];
+	}
+
+	for ( ; i < MEM_STATS_NAME_MAX; i++ ){
+		stats->name[i] = '\0';
+	}
+
+	blocks = slab->free.size + slab->partial.size + slab->full.size;
+
+	stats->obj_size       = slab->obj_size;
+	stats->objs_per_block = slab->objs_per_block;
+	stats->block_pages    = slab->block_pages;
+	stats->objs_in_use    = slab->objs_out - cached;
+	stats->objs_cached    = cached;
+	stats->free_pages     = slab->free.size    * slab->block_pages;
+	stats->partial_pages  = slab->partial.size * slab->block_pages;
+	stats->full_pages     = slab->full.size    * slab->block_pages;
+	stats->waste_bytes    =
+		blocks * (slab_block_size( slab )
+		          - slab->objs_per_block * slab->obj_size)
+		+ stats->objs_in_use * (slab->obj_size - slab->req_size);
+}
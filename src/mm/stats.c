@@ -0,0 +1,28 @@
+#include <c4/mm/stats.h>
+#include <c4/mm/phys.h>
+#include <c4/mm/region.h>
+#include <c4/mm/slab.h>
+#include <c4/mm/addrspace.h>
+#include <c4/paging.h>
+
+void mem_stats_collect( mem_stats_t *stats, unsigned size, addr_space_t *space ){
+	unsigned max_slabs = (size - sizeof( mem_stats_t )) / sizeof( mem_slab_stats_t );
+
+	phys_get_stats( &stats->phys );
+	stats->phys.page_table_pages = page_table_count( );
+
+	region_get_stats( region_get_global( ), &stats->region );
+	addr_map_get_stats( space->map, &stats->map );
+
+	stats->slab_total = 0;
+	stats->slab_count = 0;
+
+	for ( slab_t *slab = slab_first( ); slab; slab = slab->next_slab ){
+		if ( stats->slab_count < max_slabs ){
+			slab_get_stats( slab, stats->slabs + stats->slab_count );
+			stats->slab_count++;
+		}
+
+		stats->slab_total++;
+	}
+}
@@ -1,5 +1,6 @@
 k-obj += src/main.o
 k-obj += src/klib/string.o
+k-obj += src/klib/bitmap.o
 k-obj += src/debug.o
 k-obj += src/paging.o
 k-obj += src/thread.o
@@ -9,4 +10,8 @@ k-obj += src/syscall.o
 k-obj += src/interrupts.o
 k-obj += src/mm/region.o
 k-obj += src/mm/slab.o
+k-obj += src/mm/kmalloc.o
+k-obj += src/mm/phys.o
 k-obj += src/mm/addrspace.o
+k-obj += src/mm/addrmap.o
+k-obj += src/mm/stats.o
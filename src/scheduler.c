@@ -1,12 +1,21 @@
 #include <c4/scheduler.h>
 #include <c4/klib/string.h>
+#include <c4/mm/kmalloc.h>
 #include <c4/thread.h>
 #include <c4/debug.h>
 #include <c4/common.h>
+#include <stdbool.h>
 
 static thread_list_t sched_list;
+// threads with a real-time priority, these are always picked over
+// threads in sched_list when any of them are runnable
+static thread_list_t sched_rt_list;
 static thread_t *current_thread;
-
+// set when a thread with a higher priority than the current thread is
+// woken up, checked on the way out of interrupt handlers
+static bool preempt_pending = false;
+// number of timer interrupts since the scheduler started
+static unsigned long tick_count = 0;
 // TODO: once SMP is working, each CPU will need its own idle thread
 static thread_t *global_idle_thread = NULL;
 
@@ -16,9 +25,39 @@ static void idle_thread( void ){
 	}
 }
 
+// threads which have exited but haven't been freed yet. an exiting thread
+// is still running on its own kernel stack, so freeing it is left to the
+// reaper thread.
+static thread_list_t sched_zombie_list;
+static thread_t *reaper_thread = NULL;
+
+static void reaper( void ){
+	for (;;) {
+		thread_t *thread;
+
+		// threads exit from syscalls and interrupt handlers, keep those
+		// from touching the zombie list while it's being emptied here
+		asm volatile ( "cli" );
+
+		while (( thread = thread_list_pop( &sched_zombie_list ))){
+			debug_printf( "reaping thread %u\n", thread->id );
+			thread_destroy( thread );
+		}
+
+		reaper_thread->state = SCHED_STATE_WAITING;
+		sched_thread_yield( );
+	}
+}
+
 void init_scheduler( void ){
-	memset( &sched_list, 0, sizeof(thread_list_t) );
+	memset( &sched_list,    0, sizeof(thread_list_t) );
+	memset( &sched_rt_list, 0, sizeof(thread_list_t) );
+	memset( &sched_zombie_list, 0, sizeof(thread_list_t) );
 	global_idle_thread = thread_create_kthread( idle_thread );
+	reaper_thread      = thread_create_kthread( reaper );
+
+	reaper_thread->state = SCHED_STATE_WAITING;
+	sched_add_thread( reaper_thread );
 
 	current_thread = NULL;
 }
@@ -36,12 +75,82 @@ static inline thread_t *next_thread( thread_t *thread ){
 	return foo;
 }
 
+// refills the context's budget if a new period has started, and returns
+// whether it has any time left
+static bool sched_context_has_budget( sched_context_t *ctx ){
+	if ( !ctx ){
+		return true;
+	}
+
+	if ( (long)(tick_count - ctx->replenish) >= 0 ){
+		ctx->remaining = ctx->budget;
+		ctx->replenish = tick_count + ctx->period;
+	}
+
+	return ctx->remaining > 0;
+}
+
+static inline bool thread_is_runnable( thread_t *thread ){
+	return thread->state == SCHED_STATE_RUNNING
+	    && sched_context_has_budget( sched_thread_context( thread ));
+}
+
+// returns the highest priority runnable real-time thread, or NULL if there
+// aren't any. the search starts after the current thread so that real-time
+// threads with the same priority take turns.
+static thread_t *next_realtime_thread( void ){
+	thread_node_t *start = sched_rt_list.first;
+	thread_node_t *node;
+	thread_t *ret = NULL;
+
+	if ( !start ){
+		return NULL;
+	}
+
+	if ( current_thread
+	  && current_thread->sched.list == &sched_rt_list
+	  && current_thread->sched.next )
+	{
+		start = current_thread->sched.next;
+	}
+
+	node = start;
+
+	do {
+		thread_t *thread = node->thread;
+
+		if ( (!ret || thread->priority > ret->priority )
+		  && thread_is_runnable( thread ))
+		{
+			ret = thread;
+		}
+
+		node = node->next? node->next : sched_rt_list.first;
+	} while ( node != start );
+
+	return ret;
+}
+
 // TODO: rewrite scheduler to use a proper priority queue, move blocked
 //       threads to seperate lists/queues/whatever
 void sched_switch_thread( void ){
 	thread_t *next;
 	thread_t *start;
 
+	preempt_pending = false;
+
+	next = next_realtime_thread( );
+
+	if ( next ){
+		sched_jump_to_thread( next );
+		return;
+	}
+
+	if ( !sched_list.first ){
+		sched_jump_to_thread( global_idle_thread );
+		return;
+	}
+
 	if ( !current_thread
 	  || current_thread == global_idle_thread
 	  || current_thread->sched.list != &sched_list )
@@ -55,7 +164,7 @@ void sched_switch_thread( void ){
 	}
 
 	// TODO: move threads to a seperate 'waiting' list
-	while ( next->state != SCHED_STATE_RUNNING ){
+	while ( !thread_is_runnable( next )){
 		next = next_thread( next );
 
 		if ( next == start ){
@@ -63,7 +172,7 @@ void sched_switch_thread( void ){
 		}
 	}
 
-	if ( next->state != SCHED_STATE_RUNNING ){
+	if ( !thread_is_runnable( next )){
 		sched_jump_to_thread( global_idle_thread );
 
 	} else {
@@ -71,41 +180,213 @@ void sched_switch_thread( void ){
 	}
 }
 
-void kernel_stack_set( void *addr );
-void *kernel_stack_get( void );
-
 void sched_jump_to_thread( thread_t *thread ){
 	thread_t *cur = current_thread;
 	current_thread = thread;
 
-	if ( !cur || thread->addr_space != cur->addr_space ){
-		// XXX: cause a page fault if the address of the new page
-		//      directory isn't mapped here, so it can be mapped in
-		//      the page fault handler (and not cause a triple fault)
-		volatile char *a = (char *)thread->addr_space->page_dir;
-		volatile char  b = *a;
-		// and keep compiler from complaining about used variable
-		b = b;
-
-		//set_page_dir( thread->addr_space->page_dir );
+	// kernel threads only touch kernel memory, which is mapped the same
+	// in every address space, so they run on whichever space is loaded.
+	// this way going user -> idle -> same user thread never reloads CR3.
+	if ( (thread->flags & THREAD_FLAG_USER)
+	  && thread->addr_space != addr_space_active( ))
+	{
 		addr_space_set( thread->addr_space );
 	}
 
-	// swap per-thread kernel stacks
-	if ( cur ){
-		cur->kernel_stack = kernel_stack_get( );
+	thread_fpu_switch( thread );
+
+	// user threads share the per-cpu kernel stack, so the current thread's
+	// user state is saved off of it and nothing else is kept. the switch
+	// below doesn't return for them, see sched_thread_block().
+	if ( cur && (cur->flags & THREAD_FLAG_USER)){
+		thread_save_user_state( cur );
+		cur = NULL;
+	}
+
+	if ( thread->flags & THREAD_FLAG_USER ){
+		thread_load_user_state( thread );
 	}
-	kernel_stack_set( thread->kernel_stack );
 
 	sched_do_thread_switch( cur, thread );
 }
 
+// blocks the current thread until it's woken up and switched back to,
+// then runs 'cont'. user threads don't keep their kernel stack while
+// they're switched out, so for them this never returns: 'cont' runs on a
+// fresh stack, and has to finish whatever syscall the thread was in
+// (see thread_set_syscall_return()) before it returns to user mode.
+// kernel threads keep their stacks, and just call 'cont' here.
+void sched_thread_block( thread_cont_t cont ){
+	thread_t *cur = current_thread;
+
+	if ( cur->flags & THREAD_FLAG_USER ){
+		cur->continuation = cont;
+		sched_switch_thread( );
+
+		// not reached
+		for (;;);
+	}
+
+	sched_switch_thread( );
+	cont( cur );
+}
+
 void sched_thread_yield( void ){
 	sched_switch_thread( );
 }
 
+bool sched_thread_can_yield_to( thread_t *thread ){
+	return thread
+	    && thread != current_thread
+	    && thread != global_idle_thread
+	    && thread_is_runnable( thread );
+}
+
+// switches straight to the given thread if it can run, skipping the search
+// for the next thread. falls back to a normal yield and returns false
+// if it can't.
+bool sched_thread_yield_to( thread_t *thread ){
+	if ( !sched_thread_can_yield_to( thread )){
+		sched_thread_yield( );
+		return false;
+	}
+
+	sched_jump_to_thread( thread );
+	return true;
+}
+
 void sched_add_thread( thread_t *thread ){
-	thread_list_insert( &sched_list, &thread->sched );
+	if ( thread->priority > SCHED_PRIORITY_NORMAL ){
+		thread_list_insert( &sched_rt_list, &thread->sched );
+
+	} else {
+		thread_list_insert( &sched_list, &thread->sched );
+	}
+}
+
+// moves a thread between the normal and real-time run lists, threads that
+// are blocked sending a message are left in the target's waiting list and
+// are put in the right run list when they're requeued
+void sched_thread_set_priority( thread_t *thread, unsigned priority ){
+	thread_list_t *list = thread->sched.list;
+
+	if ( priority > SCHED_PRIORITY_MAX ){
+		priority = SCHED_PRIORITY_MAX;
+	}
+
+	thread->priority = priority;
+
+	if ( list == &sched_list || list == &sched_rt_list ){
+		thread_list_remove( &thread->sched );
+		sched_add_thread( thread );
+	}
+}
+
+// called when a blocked thread is made runnable from an interrupt handler
+// or syscall. if the thread should run before the current one, the switch
+// happens as soon as the handler returns instead of at the next timer tick.
+void sched_thread_wakeup( thread_t *thread ){
+	if ( !current_thread
+	  || current_thread == global_idle_thread
+	  || thread->priority > current_thread->priority )
+	{
+		preempt_pending = true;
+	}
+}
+
+void sched_preempt_check( void ){
+	if ( preempt_pending ){
+		sched_switch_thread( );
+	}
+}
+
+// charges the tick to whichever context the current thread is running on,
+// then picks the next thread to run
+void sched_timer_tick( void ){
+	tick_count++;
+
+	if ( current_thread ){
+		sched_context_t *ctx = sched_thread_context( current_thread );
+
+		if ( ctx && ctx->remaining ){
+			ctx->remaining--;
+		}
+	}
+
+	sched_switch_thread( );
+}
+
+unsigned long sched_ticks( void ){
+	return tick_count;
+}
+
+sched_context_t *sched_context_create( unsigned budget, unsigned period ){
+	sched_context_t *ret = kmalloc( sizeof( sched_context_t ));
+
+	KASSERT( ret != NULL );
+
+	ret->budget     = budget;
+	ret->period     = (period > budget)? period : budget;
+	ret->remaining  = budget;
+	ret->replenish  = tick_count + ret->period;
+	ret->references = 1;
+
+	return ret;
+}
+
+sched_context_t *sched_context_reference( sched_context_t *ctx ){
+	if ( ctx ){
+		ctx->references++;
+	}
+
+	return ctx;
+}
+
+void sched_context_free( sched_context_t *ctx ){
+	if ( ctx && --ctx->references == 0 ){
+		kfree( ctx );
+	}
+}
+
+// returns the context the thread's time is charged to
+sched_context_t *sched_thread_context( thread_t *thread ){
+	return thread->donated_ctx? thread->donated_ctx : thread->sched_ctx;
+}
+
+// replaces the thread's own context, passing NULL removes any limit
+void sched_thread_set_context( thread_t *thread, sched_context_t *ctx ){
+	sched_context_free( thread->sched_ctx );
+	thread->sched_ctx = ctx;
+}
+
+// called when 'to' recieves a synchronous message from 'from'. for a
+// request, 'to' runs on the sender's context until it releases it by
+// waiting for another message. a reply to the client that lent 'from' its
+// context hands the context back instead, so clients never run on their
+// server's time.
+void sched_thread_donate( thread_t *from, thread_t *to ){
+	if ( from->donor && from->donor == to->id ){
+		sched_thread_release_donation( from );
+		return;
+	}
+
+	sched_context_t *ctx = sched_thread_context( from );
+
+	sched_thread_release_donation( to );
+	to->donor = from->id;
+
+	if ( ctx && ctx != to->sched_ctx ){
+		to->donated_ctx = sched_context_reference( ctx );
+	}
+}
+
+void sched_thread_release_donation( thread_t *thread ){
+	if ( thread->donated_ctx ){
+		sched_context_free( thread->donated_ctx );
+		thread->donated_ctx = NULL;
+	}
+
+	thread->donor = 0;
 }
 
 void sched_thread_continue( thread_t *thread ){
@@ -120,20 +401,32 @@ void sched_thread_stop( thread_t *thread ){
 	}
 }
 
-void sched_thread_exit( void ){
-	debug_printf( "got to exit, thread %u\n", current_thread->id );
+// takes a thread off of whatever list it's in and hands it to the reaper,
+// the thread won't be run again
+void sched_thread_kill( thread_t *thread ){
+	if ( thread == global_idle_thread
+	  || thread == reaper_thread
+	  || thread->state == SCHED_STATE_EXITED )
+	{
+		return;
+	}
 
-	// TODO: Add syncronization here, to prevent current_thread from
-	//       being left in an inconsistent state if a task switch happens
-	//       this will probably crash randomly until it's fixed
+	thread->state = SCHED_STATE_EXITED;
+	thread_list_remove( &thread->sched );
+	thread_list_insert( &sched_zombie_list, &thread->sched );
 
-	thread_list_remove( &current_thread->sched );
-	current_thread = NULL;
+	reaper_thread->state = SCHED_STATE_RUNNING;
+}
 
+void sched_thread_exit( void ){
+	debug_printf( "got to exit, thread %u\n", current_thread->id );
+
+	sched_thread_kill( current_thread );
 	sched_thread_yield( );
 
+	// should never get here, the reaper frees the thread before it
+	// could be switched back to
 	for (;;);
-
 }
 
 thread_t *sched_current_thread( void ){
@@ -3,6 +3,7 @@
 #include <c4/message.h>
 #include <c4/thread.h>
 #include <c4/scheduler.h>
+#include <c4/common.h>
 
 typedef uintptr_t arg_t;
 typedef int (*syscall_func_t)( arg_t a, arg_t b, arg_t c, arg_t d );
@@ -19,6 +20,7 @@ static int syscall_recieve_async( arg_t a, arg_t b, arg_t c, arg_t d );
 //      accessible in usermode, on x86(_64), since this will definitely
 //      cause issues when writing more complex drivers
 static int syscall_ioport( arg_t a, arg_t b, arg_t c, arg_t d );
+static int syscall_yield( arg_t a, arg_t b, arg_t c, arg_t d );
 
 static const syscall_func_t syscall_table[SYSCALL_MAX] = {
 	syscall_exit,
@@ -28,6 +30,7 @@ static const syscall_func_t syscall_table[SYSCALL_MAX] = {
 	syscall_send_async,
 	syscall_recieve_async,
 	syscall_ioport,
+	syscall_yield,
 };
 
 int syscall_dispatch( unsigned num, arg_t a, arg_t b, arg_t c, arg_t d ){
@@ -41,6 +44,8 @@ int syscall_dispatch( unsigned num, arg_t a, arg_t b, arg_t c, arg_t d ){
 static int syscall_exit( arg_t a, arg_t b, arg_t c, arg_t d ){
 	debug_printf( "got exit with %u, %u, and %u\n", a, b, c );
 
+	sched_thread_exit( );
+
 	return 0;
 }
 
@@ -54,60 +59,113 @@ static int syscall_create_thread( arg_t user_entry,
 
 	thread_t *thread;
 	thread_t *cur = sched_current_thread( );
+	addr_space_t *space = NULL;
 
-	if ( !is_user_address( entry ) || !is_user_address( stack ))
-	{
-		debug_printf( "%s: invalid argument, entry: %p, stack: %p\n",
-		              entry, stack );
+	if ( flags & THREAD_CREATE_FLAG_CLONE ){
+		space = addr_space_clone( cur->addr_space );
 
-		return -1;
+		if ( !space ){
+			return -1;
+		}
+
+	} else if ( flags & THREAD_CREATE_FLAG_NEWMAP ){
+		space = NULL;
+
+		if ( flags & THREAD_CREATE_FLAG_SMALL ){
+			space = addr_space_create_small( );
+		}
+
+		// fall back to a normal address space if there aren't any small
+		// space slots left
+		if ( !space ){
+			space = addr_space_clone( addr_space_kernel( ));
+		}
+
+	} else {
+		// each thread holds a reference, so the space is freed when the
+		// last thread using it exits
+		space = addr_space_reference( cur->addr_space );
 	}
 
-	addr_space_t *space = cur->addr_space;
+	// entry and stack are addresses in the new thread's address space
+	if ( !addr_space_user_linear( space, user_entry, 1 )
+	  || !addr_space_user_linear( space, user_stack, 1 ))
+	{
+		debug_printf( "%s: invalid argument, entry: %p, stack: %p\n",
+		              __func__, entry, stack );
 
-	if ( flags & THREAD_CREATE_FLAG_CLONE ){
-		space = addr_space_clone( space );
+		addr_space_free( space );
 
-	} else if ( flags & THREAD_CREATE_FLAG_NEWMAP ){
-		space = addr_space_clone( addr_space_kernel( ));
+		return -1;
 	}
 
 	thread = thread_create( entry, space, stack, THREAD_FLAG_USER );
 
+	// new threads share their creator's pager, or are paged by the
+	// creator itself if it doesn't have one
+	thread->pager = cur->pager? cur->pager : cur->id;
+
 	sched_thread_stop( thread );
 	sched_add_thread( thread );
 
 	debug_printf( ">> created user thread %u\n", thread->id );
-	debug_printf( ">>      entry: %p\n", thread->registers.eip );
-	debug_printf( ">>      stack: %p\n", thread->registers.esp );
+	debug_printf( ">>      entry: %p\n", entry );
+	debug_printf( ">>      stack: %p\n", stack );
 	debug_printf( ">>    current: %p\n", thread );
 
 	return thread->id;
 }
 
+// translates a message buffer passed by the current thread into a pointer
+// the kernel can use, or NULL if the buffer isn't accessible to the thread.
+// the buffer is faulted in first if it isn't mapped yet, see
+// message_fault_in_user(), so this only returns once it is.
+static inline message_t *user_message_buffer( arg_t buffer, bool write ){
+	thread_t *cur = sched_current_thread( );
+	uintptr_t ret = addr_space_user_linear( cur->addr_space,
+	                                        buffer,
+	                                        sizeof( message_t ));
+
+	if ( ret ){
+		message_fault_in_user( ret, sizeof( message_t ), write );
+	}
+
+	return (message_t *)ret;
+}
+
+// copies a message out of a user buffer from user_message_buffer(), so
+// nothing touches the buffer once the syscall has a chance to block
+static inline void user_message_read( message_t *dest, message_t *buffer ){
+	message_user_access_begin( );
+	*dest = *buffer;
+	message_user_access_end( );
+}
+
 static int syscall_send( arg_t buffer, arg_t target, arg_t c, arg_t d ){
-	message_t *msg = (message_t *)buffer;
+	message_t *msg = user_message_buffer( buffer, false );
+	message_t copy;
 	//unsigned id = sched_current_thread()->id;
 
 	//debug_printf( "%u: trying to send message %p to %u\n", id, msg, target );
 
-	if ( !is_user_address( msg )){
+	if ( !msg ){
 		debug_printf( "%s: (invalid buffer, returning)\n", __func__ );
 		return -1;
 	}
 
-	message_send( msg, target );
+	user_message_read( &copy, msg );
+	message_send( &copy, target );
 
 	return 0;
 }
 
 static int syscall_recieve( arg_t buffer, arg_t from, arg_t c, arg_t d ){
-	message_t *msg = (message_t *)buffer;
+	message_t *msg = user_message_buffer( buffer, true );
 	//unsigned id = sched_current_thread()->id;
 
 	//debug_printf( "%u: trying to recieve message at %p\n", id, msg );
 
-	if ( !is_user_address( msg )){
+	if ( !msg ){
 		debug_printf( "%s: (invalid buffer, returning)\n", __func__ );
 		return -1;
 	}
@@ -118,22 +176,25 @@ static int syscall_recieve( arg_t buffer, arg_t from, arg_t c, arg_t d ){
 }
 
 static int syscall_send_async( arg_t buffer, arg_t to, arg_t c, arg_t d ){
-	message_t *msg = (message_t *)buffer;
+	message_t *msg = user_message_buffer( buffer, false );
+	message_t copy;
 
-	if ( !is_user_address( msg )){
+	if ( !msg ){
 		debug_printf( "%s: (invalid buffer, returning)\n", __func__ );
 
 		return false;
 	}
 
-	return message_send_async( msg, to );
+	user_message_read( &copy, msg );
+
+	return message_send_async( &copy, to );
 }
 
 static int syscall_recieve_async( arg_t buffer, arg_t flags, arg_t c, arg_t d )
 {
-	message_t *msg = (message_t *)buffer;
+	message_t *msg = user_message_buffer( buffer, true );
 
-	if ( !is_user_address( msg )){
+	if ( !msg ){
 		debug_printf( "%s: (invalid buffer, returning)\n", __func__ );
 
 		return false;
@@ -143,6 +204,37 @@ static int syscall_recieve_async( arg_t buffer, arg_t flags, arg_t c, arg_t d )
 }
 
 
+// gives the rest of the current time slice to the given thread, returns 0
+// if it ran, or -1 if it couldn't and a normal yield was done instead
+static int syscall_yield( arg_t target, arg_t b, arg_t c, arg_t d ){
+	thread_t *cur = sched_current_thread( );
+	thread_t *thread = NULL;
+	int ret;
+
+	switch ( target ){
+		case (arg_t)SYSCALL_YIELD_ANY:
+			thread_set_syscall_return( cur, 0 );
+			sched_thread_yield( );
+			return 0;
+
+		case (arg_t)SYSCALL_YIELD_SENDER:
+			thread = thread_get_id( cur->message.sender );
+			break;
+
+		default:
+			thread = thread_get_id( target );
+			break;
+	}
+
+	// switching away from a user thread doesn't return, so the result
+	// has to be set before yielding
+	ret = sched_thread_can_yield_to( thread )? 0 : -1;
+	thread_set_syscall_return( cur, ret );
+	sched_thread_yield_to( thread );
+
+	return ret;
+}
+
 // TODO: seriously this needs to be removed one day, don't forget!
 #ifdef __i386__
 #include <c4/arch/ioports.h>
@@ -150,8 +242,8 @@ static int syscall_recieve_async( arg_t buffer, arg_t flags, arg_t c, arg_t d )
 
 static int syscall_ioport( arg_t action, arg_t port, arg_t value, arg_t d ){
 #ifdef __i386__
-	debug_printf( "doing io stuff: %u, port %u, value %u\n",
-	              action, port, value );
+	debug_log( DEBUG_LEVEL_TRACE, "doing io stuff: %u, port %u, value %u\n",
+	           action, port, value );
 	switch ( action ){
 		case SYSCALL_IO_INPUT:
 			return inb( port );
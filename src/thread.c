@@ -1,6 +1,8 @@
 #include <c4/thread.h>
+#include <c4/scheduler.h>
 #include <c4/mm/slab.h>
 #include <c4/mm/region.h>
+#include <c4/mm/kmalloc.h>
 #include <c4/common.h>
 #include <c4/debug.h>
 
@@ -15,7 +17,7 @@ void init_threading( void ){
 	static bool initialized = false;
 
 	if ( !initialized ){
-		slab_init_at( &thread_slab, region_get_global(),
+		slab_init_at( &thread_slab, "thread", region_get_global(),
 	  	              sizeof(thread_t), NULL, NULL );
 
 		initialized = true;
@@ -44,19 +46,39 @@ thread_t *thread_create( void (*entry)(void),
 }
 
 thread_t *thread_create_kthread( void (*entry)(void)){
-	uint8_t *stack = region_alloc( region_get_global( ));
+	uint8_t *stack = kmalloc( PAGE_SIZE );
 
 	KASSERT( stack != NULL );
 	stack += PAGE_SIZE;
 
-	return thread_create( entry,
-	                      addr_space_reference( addr_space_kernel( )),
-	                      stack,
-	                      THREAD_FLAG_NONE );
+	thread_t *ret = thread_create( entry,
+	                               addr_space_reference( addr_space_kernel( )),
+	                               stack,
+	                               THREAD_FLAG_NONE );
+
+	ret->kthread_stack = stack - PAGE_SIZE;
+
+	return ret;
 }
 
+// frees everything belonging to a thread which isn't running anymore,
+// threads exit through sched_thread_exit() or sched_thread_kill(), which
+// leave the actual freeing to the reaper thread since the exiting thread
+// is still running when it exits
 void thread_destroy( thread_t *thread ){
+	thread_list_remove( &thread->sched );
 	thread_list_remove( &thread->intern );
+
+	message_thread_cleanup( thread );
+	thread_fpu_release( thread );
+	sched_thread_release_donation( thread );
+	sched_thread_set_context( thread, NULL );
+
+	if ( thread->kthread_stack ){
+		kfree( thread->kthread_stack );
+	}
+
+	addr_space_free( thread->addr_space );
 	slab_free( &thread_slab, thread );
 }
 
@@ -87,6 +109,11 @@ void thread_list_remove( thread_node_t *node ){
 		if ( node == node->list->first ){
 			node->list->first = node->next;
 		}
+
+		// so removing the node twice is harmless
+		node->list = NULL;
+		node->next = NULL;
+		node->prev = NULL;
 	}
 }
 
@@ -111,6 +138,16 @@ thread_t *thread_list_peek( thread_list_t *list ){
 	return ret;
 }
 
+void thread_for_each( void (*func)( thread_t *thread, void *data ),
+                      void *data )
+{
+	thread_node_t *node = thread_global_list.first;
+
+	for ( ; node; node = node->next ){
+		func( node->thread, data );
+	}
+}
+
 thread_t *thread_get_id( unsigned id ){
 	thread_node_t *node = thread_global_list.first;
 
@@ -0,0 +1,308 @@
+// hosted tests and benchmarks for src/klib/bitmap.c, built with the host
+// compiler by 'make check'. every search is compared against a bit at a
+// time reference implementation over randomly filled bitmaps.
+#include <c4/klib/bitmap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum {
+	TEST_BITS   = 1000,
+	TEST_ROUNDS = 2000,
+
+	BENCH_BITS  = 1 << 16,
+	BENCH_ITERS = 2000,
+};
+
+static unsigned failures = 0;
+
+#define CHECK( cond, ... ) \
+	do { \
+		if ( !(cond) ){ \
+			printf( "FAIL %s:%u: ", __func__, __LINE__ ); \
+			printf( __VA_ARGS__ ); \
+			printf( "\n" ); \
+			failures++; \
+		} \
+	} while ( 0 )
+
+static uint32_t rand_state = 0x12345678;
+
+// xorshift, so results are the same on every host
+static uint32_t test_rand( void ){
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+
+	return rand_state;
+}
+
+static unsigned test_rand_below( unsigned limit ){
+	return test_rand( ) % limit;
+}
+
+// reference implementations, one bit at a time
+static int ref_first_free_run( bitmap_ent_t *bitmap,
+                               unsigned limit,
+                               unsigned count,
+                               unsigned align )
+{
+	for ( unsigned i = 0; i + count <= limit; i += align ){
+		unsigned k = 0;
+
+		while ( k < count && !bitmap_get( bitmap, i + k )){
+			k++;
+		}
+
+		if ( k == count ){
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static int ref_first_set( bitmap_ent_t *bitmap, unsigned start, unsigned end ){
+	for ( unsigned i = start; i < end; i++ ){
+		if ( bitmap_get( bitmap, i )){
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static unsigned ref_largest_free_run( bitmap_ent_t *bitmap, unsigned limit ){
+	unsigned ret = 0;
+	unsigned run = 0;
+
+	for ( unsigned i = 0; i < limit; i++ ){
+		run = bitmap_get( bitmap, i )? 0 : run + 1;
+		ret = (run > ret)? run : ret;
+	}
+
+	return ret;
+}
+
+// sets bits with the given chance out of 256, in clumps so that there are
+// both long free runs and long used ones
+static void fill_random( bitmap_ent_t *bitmap, unsigned bits, unsigned density ){
+	memset( bitmap, 0, BITMAP_WORDS( bits ) * sizeof( bitmap_ent_t ));
+
+	for ( unsigned i = 0; i < bits; ){
+		unsigned len = test_rand_below( 40 ) + 1;
+
+		if ( len > bits - i ){
+			len = bits - i;
+		}
+
+		if ( test_rand_below( 256 ) < density ){
+			bitmap_set_range( bitmap, i, len );
+		}
+
+		i += len;
+	}
+}
+
+static void test_ctz( void ){
+	for ( unsigned i = 0; i < BITMAP_BPS; i++ ){
+		bitmap_ent_t ent = (bitmap_ent_t)1 << i;
+
+		CHECK( bitmap_ctz( ent ) == i, "ctz of bit %u", i );
+		CHECK( bitmap_ctz( ent | BITMAP_ENT_FULL << i ) == i,
+		       "ctz with higher bits, bit %u", i );
+	}
+}
+
+static void test_ranges( void ){
+	bitmap_ent_t bitmap[BITMAP_WORDS( TEST_BITS )];
+	uint8_t ref[TEST_BITS];
+
+	memset( bitmap, 0, sizeof( bitmap ));
+	memset( ref, 0, sizeof( ref ));
+
+	for ( unsigned round = 0; round < TEST_ROUNDS; round++ ){
+		unsigned start = test_rand_below( TEST_BITS );
+		unsigned count = test_rand_below( TEST_BITS - start + 1 );
+		bool set       = test_rand( ) & 1;
+
+		if ( set ){
+			bitmap_set_range( bitmap, start, count );
+
+		} else {
+			bitmap_unset_range( bitmap, start, count );
+		}
+
+		memset( ref + start, set, count );
+
+		for ( unsigned i = 0; i < TEST_BITS; i++ ){
+			if ( bitmap_get( bitmap, i ) != ref[i] ){
+				CHECK( false, "bit %u wrong after %s of [%u, %u)",
+				       i, set? "set" : "unset", start, start + count );
+				return;
+			}
+		}
+	}
+}
+
+static void test_searches( void ){
+	bitmap_ent_t bitmap[BITMAP_WORDS( TEST_BITS )];
+
+	for ( unsigned round = 0; round < TEST_ROUNDS; round++ ){
+		unsigned limit = test_rand_below( TEST_BITS ) + 1;
+		unsigned count = test_rand_below( 64 ) + 1;
+		unsigned align = 1 << test_rand_below( 6 );
+		unsigned start = test_rand_below( limit );
+		unsigned end   = start + test_rand_below( limit - start + 1 );
+
+		fill_random( bitmap, TEST_BITS, test_rand_below( 256 ));
+
+		int want = ref_first_free_run( bitmap, limit, 1, 1 );
+		int got  = bitmap_first_free( bitmap, limit );
+		CHECK( got == want, "first_free: %d, expected %d", got, want );
+
+		want = ref_first_free_run( bitmap, limit, count, 1 );
+		got  = bitmap_first_free_run( bitmap, limit, count );
+		CHECK( got == want, "first_free_run( %u ): %d, expected %d",
+		       count, got, want );
+
+		want = ref_first_free_run( bitmap, limit, count, align );
+		got  = bitmap_first_free_run_aligned( bitmap, limit, count, align );
+		CHECK( got == want, "first_free_run_aligned( %u, %u ): %d, expected %d",
+		       count, align, got, want );
+
+		want = ref_first_set( bitmap, start, end );
+		got  = bitmap_first_set( bitmap, start, end );
+		CHECK( got == want, "first_set( %u, %u ): %d, expected %d",
+		       start, end, got, want );
+
+		unsigned largest = bitmap_largest_free_run( bitmap, limit );
+		unsigned ref     = ref_largest_free_run( bitmap, limit );
+		CHECK( largest == ref, "largest_free_run: %u, expected %u",
+		       largest, ref );
+	}
+}
+
+static bool hbitmap_summary_ok( hbitmap_t *hbitmap ){
+	for ( unsigned word = 0; word < BITMAP_WORDS( hbitmap->bits ); word++ ){
+		bool full = hbitmap->map[word] == BITMAP_ENT_FULL;
+
+		if ( bitmap_get( hbitmap->summary, word ) != full ){
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void test_hbitmap( void ){
+	// enough bits for more than one summary section, and not a multiple
+	// of the section size so the tail handling gets tested too
+	enum { BITS = BITMAP_BPS * BITMAP_BPS * 2 + 100 };
+	static bitmap_ent_t map[BITMAP_WORDS( BITS )];
+	static bitmap_ent_t summary[HBITMAP_SUMMARY_WORDS( BITS )];
+	hbitmap_t hbitmap;
+
+	hbitmap_init( &hbitmap, map, summary, BITS );
+	CHECK( hbitmap_first_free( &hbitmap ) == 0, "empty bitmap" );
+
+	for ( unsigned round = 0; round < TEST_ROUNDS; round++ ){
+		unsigned start = test_rand_below( BITS );
+		unsigned count = test_rand_below( BITS - start + 1 );
+		unsigned run   = test_rand_below( 200 ) + 1;
+		unsigned align = 1 << test_rand_below( 5 );
+
+		// mostly set bits, so that there are plenty of full sections
+		if ( test_rand_below( 4 )){
+			hbitmap_set_range( &hbitmap, start, count );
+
+		} else if ( count == 1 ){
+			hbitmap_unset( &hbitmap, start );
+
+		} else {
+			hbitmap_unset_range( &hbitmap, start, count % 300 );
+		}
+
+		CHECK( hbitmap_summary_ok( &hbitmap ), "summary out of sync" );
+
+		int want = ref_first_free_run( map, BITS, 1, 1 );
+		int got  = hbitmap_first_free( &hbitmap );
+		CHECK( got == want, "hbitmap_first_free: %d, expected %d", got, want );
+
+		want = ref_first_free_run( map, BITS, run, align );
+		got  = hbitmap_first_free_run( &hbitmap, run, align );
+		CHECK( got == want, "hbitmap_first_free_run( %u, %u ): %d, expected %d",
+		       run, align, got, want );
+	}
+
+	hbitmap_set_range( &hbitmap, 0, BITS );
+	CHECK( hbitmap_first_free( &hbitmap ) == -1, "full bitmap" );
+	CHECK( hbitmap_first_free_run( &hbitmap, 2, 1 ) == -1, "full bitmap run" );
+}
+
+static double bench_seconds( void ){
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// a nearly full bitmap with the only free run near the end, which is
+// what the region allocator sees once the kernel heap fills up
+static void bench_runs( void ){
+	static bitmap_ent_t map[BITMAP_WORDS( BENCH_BITS )];
+	static bitmap_ent_t summary[HBITMAP_SUMMARY_WORDS( BENCH_BITS )];
+	hbitmap_t hbitmap;
+	volatile int sink = 0;
+	double start;
+
+	hbitmap_init( &hbitmap, map, summary, BENCH_BITS );
+	hbitmap_set_range( &hbitmap, 0, BENCH_BITS );
+	hbitmap_unset_range( &hbitmap, BENCH_BITS - 100, 16 );
+
+	start = bench_seconds( );
+	for ( unsigned i = 0; i < BENCH_ITERS; i++ ){
+		sink += ref_first_free_run( map, BENCH_BITS, 16, 1 );
+	}
+	double ref = bench_seconds( ) - start;
+
+	start = bench_seconds( );
+	for ( unsigned i = 0; i < BENCH_ITERS; i++ ){
+		sink += bitmap_first_free_run( map, BENCH_BITS, 16 );
+	}
+	double flat = bench_seconds( ) - start;
+
+	start = bench_seconds( );
+	for ( unsigned i = 0; i < BENCH_ITERS; i++ ){
+		sink += hbitmap_first_free_run( &hbitmap, 16, 1 );
+	}
+	double two_level = bench_seconds( ) - start;
+
+	printf( "first free run of 16 in %u bits, ns per search:\n", BENCH_BITS );
+	printf( "    bit at a time: %10.1f\n", ref * 1e9 / BENCH_ITERS );
+	printf( "    bitmap:        %10.1f\n", flat * 1e9 / BENCH_ITERS );
+	printf( "    hbitmap:       %10.1f\n", two_level * 1e9 / BENCH_ITERS );
+	(void)sink;
+}
+
+int main( int argc, char *argv[] ){
+	test_ctz( );
+	test_ranges( );
+	test_searches( );
+	test_hbitmap( );
+
+	if ( failures ){
+		printf( "bitmap: %u failures\n", failures );
+		return 1;
+	}
+
+	printf( "bitmap: all tests passed\n" );
+
+	if ( argc > 1 && strcmp( argv[1], "bench" ) == 0 ){
+		bench_runs( );
+	}
+
+	return 0;
+}
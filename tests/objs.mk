@@ -0,0 +1,18 @@
+# hosted tests, built with the host compiler rather than the cross compiler.
+# 'make check' runs them, 'make bench' runs them and then the benchmarks.
+HOST_CC     = cc
+TEST_CFLAGS = -Wall -g -O2 -I./include/ -I./arch/$(ARCH)/include/
+
+tests/bitmap_test: tests/bitmap_test.c src/klib/bitmap.c
+	@echo CC $< -o $@
+	@$(HOST_CC) $(TEST_CFLAGS) tests/bitmap_test.c src/klib/bitmap.c -o $@
+
+.PHONY: check
+check: tests/bitmap_test
+	@./tests/bitmap_test
+
+.PHONY: bench
+bench: tests/bitmap_test
+	@./tests/bitmap_test bench
+
+ALL_CLEAN += tests/bitmap_test